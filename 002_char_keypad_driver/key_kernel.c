@@ -6,36 +6,142 @@
 #include <linux/cdev.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/mm.h>
+#include "keypad_event.h"
 
-extern void keypad_inject_event(int);
-extern void keypad_get_event(char*);
-extern void keypad_clear_queue(void);
+extern int keypad_inject_events(const char *, unsigned int);
+extern int keypad_report_events(const struct keypad_event *, unsigned int);
+extern int keypad_read_events(struct keypad_event *, unsigned int, bool);
+extern __poll_t keypad_poll(struct file *, poll_table *);
+extern int keypad_clear_queue(void);
+extern int keypad_resize_queue(unsigned int);
+extern int keypad_mmap(struct vm_area_struct *);
+
+/* Upper bound on events moved by a single read()/write() */
+#define KEYPAD_MAX_BATCH 1024
 
 #define CLEAR_BUF _IO('a', 0x11)
+#define RESIZE_BUF _IOW('a', 0x12, unsigned int)
+#define EVENT_MODE _IOW('a', 0x13, int)
 
 struct class *cl;
 struct device *device_node;
 dev_t dev_num;
 struct cdev my_dev;
 
+/* Per-open read()/write() format, selected with EVENT_MODE */
+#define KEYPAD_FMT_CHAR  0	/* one byte per key press (default) */
+#define KEYPAD_FMT_EVENT 1	/* struct keypad_event records */
+
+static bool event_fmt(struct file *fp)
+{
+	return (unsigned long)fp->private_data == KEYPAD_FMT_EVENT;
+}
+
+/*
+ * Char format: squeeze the key codes of press events down to the start of
+ * the same buffer. Byte j never passes record i, so this is safe in place.
+ */
+static int events_to_keys(struct keypad_event *events, int n)
+{
+	char *keys = (char *)events;
+	int i, j = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].type == KEYPAD_EV_PRESS)
+		{
+			char code = events[i].code;
+			keys[j++] = code;
+		}
+	}
+	return j;
+}
+
 static ssize_t device_read(struct file *fp, char __user *usr_buf, size_t len, loff_t *off)
 {
-	char val;
-	keypad_get_event(&val);
-	if (copy_to_user(usr_buf, &val, sizeof(val)))
-		return -EFAULT;
-	pr_info("Read Completed: %c\n", val);
-	return 1;
+	size_t rec = event_fmt(fp) ? sizeof(struct keypad_event) : 1;
+	bool nonblock = fp->f_flags & O_NONBLOCK;
+	struct keypad_event *events;
+	unsigned int n;
+	ssize_t ret;
+
+	n = min_t(size_t, len / rec, KEYPAD_MAX_BATCH);
+	if (!n)
+		return len ? -EINVAL : 0;
+
+	events = kmalloc_array(n, sizeof(*events), GFP_KERNEL);
+	if (!events)
+		return -ENOMEM;
+
+	/* Sleeps until events arrive unless O_NONBLOCK; one merge, one copy out */
+	for (;;)
+	{
+		ret = keypad_read_events(events, n, nonblock);
+		if (ret <= 0 || event_fmt(fp))
+			break;
+		/* Releases carry no byte; keep going if that was all we got */
+		ret = events_to_keys(events, ret);
+		if (ret)
+			break;
+		if (nonblock)
+		{
+			ret = -EAGAIN;
+			break;
+		}
+	}
+
+	if (ret > 0)
+	{
+		ret *= rec;
+		if (copy_to_user(usr_buf, events, ret))
+			ret = -EFAULT;
+	}
+
+	kfree(events);
+	pr_debug("Read Completed: %zd bytes\n", ret);
+	return ret;
 }
 
 static ssize_t device_write(struct file *fp, const char __user *usr_buf, size_t len, loff_t *off)
 {
-	char val;	
-	if (copy_from_user(&val, usr_buf, sizeof(val)))
-		return -EFAULT;
-	keypad_inject_event(val);
-	pr_info("Write Completed: %c\n", val);
-	return 1;
+	size_t rec = event_fmt(fp) ? sizeof(struct keypad_event) : 1;
+	unsigned int n;
+	void *buf;
+	int put;
+
+	n = min_t(size_t, len / rec, KEYPAD_MAX_BATCH);
+	if (!n)
+		return len ? -EINVAL : 0;
+
+	buf = memdup_user(usr_buf, n * rec);
+	if (IS_ERR(buf))
+		return PTR_ERR(buf);
+
+	/* Short write when the queue fills; nothing queued means try again */
+	if (event_fmt(fp))
+		put = keypad_report_events(buf, n);
+	else
+		put = keypad_inject_events(buf, n);
+	kfree(buf);
+	pr_debug("Write Completed: %d events\n", put);
+
+	if (put < 0)
+		return put;
+	return put ? put * rec : -EAGAIN;
+}
+
+static __poll_t device_poll(struct file *fp, poll_table *wait)
+{
+	return keypad_poll(fp, wait);
+}
+
+/* Shares the event rings with user space, see keypad_event.h for the layout */
+static int device_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+	return keypad_mmap(vma);
 }
 
 static int device_open(struct inode *inode, struct file *file)
@@ -52,10 +158,22 @@ static int device_release(struct inode *inode, struct file *file)
 
 static long device_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
+	unsigned int size;
+	int mode;
+
 	switch (cmd)
 	{
 	case CLEAR_BUF:
-		keypad_clear_queue();
+		return keypad_clear_queue();
+	case RESIZE_BUF:
+		if (copy_from_user(&size, (unsigned int __user *)arg, sizeof(size)))
+			return -EFAULT;
+		return keypad_resize_queue(size);
+	case EVENT_MODE:
+		if (copy_from_user(&mode, (int __user *)arg, sizeof(mode)))
+			return -EFAULT;
+		file->private_data = (void *)(unsigned long)(mode ? KEYPAD_FMT_EVENT : KEYPAD_FMT_CHAR);
+		break;
 	}
 	return 0;
 }
@@ -64,6 +182,8 @@ struct file_operations fop = {
 	.owner = THIS_MODULE,
 	.read = device_read,
 	.write = device_write,
+	.poll = device_poll,
+	.mmap = device_mmap,
 	.open = device_open,
 	.release = device_release,
 	.unlocked_ioctl = device_ioctl
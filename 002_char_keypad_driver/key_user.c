@@ -3,8 +3,80 @@
 #include<unistd.h>
 #include<string.h>
 #include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<poll.h>
+#include<time.h>
+#include "keypad_event.h"
 
 #define CLEAR_BUF _IO('a', 0x11)
+#define RESIZE_BUF _IOW('a', 0x12, unsigned int)
+#define EVENT_MODE _IOW('a', 0x13, int)
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct keypad_ring_index *ring_index(struct keypad_mmap_info *info, unsigned int i)
+{
+	return (struct keypad_ring_index *)((char *)info + info->index_offset) + i;
+}
+
+static struct keypad_event *ring_events(struct keypad_mmap_info *info, unsigned int i)
+{
+	return (struct keypad_event *)((char *)info + info->data_offset + (size_t)i * info->ring_stride);
+}
+
+/* Map the header page to learn the layout, then map every ring */
+static struct keypad_mmap_info *map_rings(int fd, size_t *len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	struct keypad_mmap_info *info = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (info == MAP_FAILED)
+		return NULL;
+	*len = info->data_offset + (size_t)info->nr_rings * info->ring_stride;
+	*len = (*len + page - 1) & ~(page - 1);
+	munmap(info, page);
+
+	info = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return info == MAP_FAILED ? NULL : info;
+}
+
+/*
+ * Take the oldest event across all rings without a syscall. head is loaded
+ * with acquire so the event is visible; tail is stored with release so the
+ * kernel reuses the slot only after we copied it out.
+ */
+static int pop_event(struct keypad_mmap_info *info, struct keypad_event *ev)
+{
+	unsigned int mask = info->ring_size - 1;
+	struct keypad_ring_index *oldest = NULL;
+	struct keypad_event *oldest_ev = NULL;
+
+	for (unsigned int i = 0; i < info->nr_rings; i++)
+	{
+		struct keypad_ring_index *idx = ring_index(info, i);
+		unsigned int tail = idx->tail;
+
+		if (__atomic_load_n(&idx->head, __ATOMIC_ACQUIRE) == tail)
+			continue;
+		struct keypad_event *e = &ring_events(info, i)[tail & mask];
+		if (!oldest_ev || e->ts_ns < oldest_ev->ts_ns)
+		{
+			oldest = idx;
+			oldest_ev = e;
+		}
+	}
+	if (!oldest)
+		return 0;
+
+	*ev = *oldest_ev;
+	__atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
 
 int main()
 {
@@ -16,17 +88,111 @@ int main()
 		return -1;
 	}
 	
-    char ch = 'a';
-    if (write(fd, &ch, 1) < 0) 
+	/* Make room for bursts; pending keys survive the resize */
+	unsigned int size = 256;
+	if (ioctl(fd, RESIZE_BUF, &size) < 0)
+		perror("Queue resize failed");
+	else
+		printf("Queue resized to %u\n", size);
+
+    /* A whole key sequence goes in with one write() ... */
+    const char keys[] = "123A456B789C*0#D";
+    ssize_t n = write(fd, keys, strlen(keys));
+    if (n < 0) 
 	{
         perror("Failed to write to device");
         close(fd);
         return 1;
     }
+	printf("Injected %zd keys\n", n);
 	
-	int myKey;
-	read(fd, &myKey, sizeof(myKey));
-	printf("Keypad Value : %d\n", myKey);
+	/* Wait for keys without spinning; read() would also block on its own */
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	if (poll(&pfd, 1, 1000) <= 0)
+	{
+		printf("No keys available\n");
+		close(fd);
+		return 1;
+	}
+
+	/* ... and comes back out with one read() */
+	char myKeys[64];
+	n = read(fd, myKeys, sizeof(myKeys));
+	if (n < 0)
+	{
+		perror("Failed to read from device");
+		close(fd);
+		return 1;
+	}
+	printf("Keypad Values : %.*s\n", (int)n, myKeys);
+
+	/* Switch this fd to event records: press/release with time stamps */
+	int mode = 1;
+	if (ioctl(fd, EVENT_MODE, &mode) < 0)
+	{
+		perror("Event mode failed");
+		close(fd);
+		return 1;
+	}
+
+	struct keypad_event evs[2] = {
+		{ .type = KEYPAD_EV_PRESS, .code = '5' },
+		{ .type = KEYPAD_EV_RELEASE, .code = '5' },
+	};
+	if (write(fd, evs, sizeof(evs)) < 0)
+	{
+		perror("Failed to inject events");
+		close(fd);
+		return 1;
+	}
+
+	n = read(fd, evs, sizeof(evs));
+	unsigned long long now = now_ns();
+	for (int i = 0; i < n / (ssize_t)sizeof(evs[0]); i++)
+	{
+		printf("Event cpu=%u seq=%u %s '%c' latency=%llu ns\n",
+			   evs[i].cpu, evs[i].seq,
+			   evs[i].type == KEYPAD_EV_PRESS ? "press" : "release",
+			   evs[i].code, now - evs[i].ts_ns);
+	}
+
+	/* Zero-copy: drain the rings from a shared mapping, poll() only when empty */
+	size_t len;
+	struct keypad_mmap_info *info = map_rings(fd, &len);
+	if (!info)
+	{
+		perror("Failed to map event rings");
+		close(fd);
+		return 1;
+	}
+	printf("Mapped %u rings of %u events\n", info->nr_rings, info->ring_size);
+
+	struct keypad_event burst[8];
+	for (int i = 0; i < 8; i++)
+	{
+		burst[i].type = i % 2 ? KEYPAD_EV_RELEASE : KEYPAD_EV_PRESS;
+		burst[i].code = "1234"[i / 2];
+	}
+	if (write(fd, burst, sizeof(burst)) < 0)
+		perror("Failed to inject events");
+
+	for (int got = 0; got < 8; )
+	{
+		struct keypad_event ev;
+
+		if (!pop_event(info, &ev))
+		{
+			if (poll(&pfd, 1, 1000) <= 0)
+				break;
+			continue;
+		}
+		got++;
+		printf("Mapped event cpu=%u seq=%u %s '%c' latency=%llu ns\n",
+			   ev.cpu, ev.seq, ev.type == KEYPAD_EV_PRESS ? "press" : "release",
+			   ev.code, now_ns() - ev.ts_ns);
+	}
+	/* read() and CLEAR_BUF work again once the rings are unmapped */
+	munmap(info, len);
 	 
 	if ((ioctl(fd, CLEAR_BUF)) < 0)
 	{
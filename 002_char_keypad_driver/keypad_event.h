@@ -0,0 +1,46 @@
+#ifndef _KEYPAD_EVENT_H
+#define _KEYPAD_EVENT_H
+
+/* Shared by the kernel modules and user space: keep it fixed-size */
+
+#include <linux/types.h>
+
+#define KEYPAD_EV_PRESS   1
+#define KEYPAD_EV_RELEASE 2
+
+/* One keypad event as stored in the queue and returned by read() */
+struct keypad_event
+{
+    __u64 ts_ns;	/* CLOCK_MONOTONIC ns when the event was injected */
+    __u32 seq;		/* per-CPU injection count; a gap means events were dropped */
+    __u16 cpu;		/* CPU whose queue carried the event */
+    __u8 type;		/* KEYPAD_EV_PRESS or KEYPAD_EV_RELEASE */
+    __u8 code;		/* key code, the character written to the device */
+};
+
+/*
+ * mmap() layout of /dev/keypadDev: struct keypad_mmap_info at offset 0,
+ * nr_rings ring indexes at index_offset and ring i's events at
+ * data_offset + i * ring_stride. Ring i is fed by CPU i. The kernel
+ * advances head, the process that mapped the rings advances tail; both
+ * are free-running and masked with ring_size - 1 to index the events.
+ */
+struct keypad_mmap_info
+{
+    __u32 nr_rings;
+    __u32 ring_size;	/* events per ring, a power of two */
+    __u32 index_offset;	/* bytes from the start of the mapping */
+    __u32 data_offset;
+    __u32 ring_stride;
+};
+
+/* head and tail sit 64 bytes apart so producer and consumer don't share a line */
+struct keypad_ring_index
+{
+    __u32 head;		/* stored with release once the events are written */
+    __u32 __pad0[15];
+    __u32 tail;		/* stored with release once the events are read */
+    __u32 __pad1[15];
+};
+
+#endif
@@ -1,53 +1,666 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/ktime.h>
+#include <linux/smp.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "queue_kernel.h"
 
-static queue keyQueue;
+/*
+ * One ring per CPU. A producer only touches its own CPU's ring, with
+ * interrupts disabled, so each ring has a single producer and runs in SPSC
+ * mode with no atomics on the injection path and no cacheline shared with
+ * other CPUs. Readers take turns (consumer_lock) as the single consumer of
+ * every ring and merge them back into injection order by timestamp.
+ *
+ * The rings and their head/tail indexes live in one vmalloc_user() area
+ * laid out as described in keypad_event.h, so a process can mmap() it and
+ * become the consumer itself. While it is mapped, in-kernel reads fail
+ * with -EBUSY and the rings can't be resized.
+ */
+struct keypad_cpu_queue
+{
+    queue q;
+    unsigned int high_water;	/* deepest this ring has been */
+    unsigned long drops;	/* events rejected because this ring was full */
+    u32 seq;			/* next sequence number stamped on this CPU */
+};
+
+static struct keypad_cpu_queue __percpu *cpu_queues;
+static void *ring_area;
+static size_t ring_area_len;
+static atomic_t mmap_count = ATOMIC_INIT(0);	/* vmas currently mapping ring_area */
+static DEFINE_SPINLOCK(consumer_lock);
+/*
+ * Every consumer holds this for read; only a resize takes it for write.
+ * Being per-CPU, the read side costs no shared cacheline.
+ */
+DEFINE_STATIC_PERCPU_RWSEM(resize_sem);
+/*
+ * Producers can't sleep on resize_sem, since keys may be injected from
+ * interrupts. They enqueue in an RCU read section instead; a resize sets
+ * rings_frozen and waits for the sections already running before it
+ * moves the rings. Keys arriving meanwhile are dropped as if their ring
+ * were full.
+ */
+static bool rings_frozen;
+
+/* Keys are stamped on the stack in batches of this many before enqueueing */
+#define KEYPAD_STAMP_BATCH 32
 
-extern void queue_init(queue *q);
-extern int enqueue(queue *q, char item);
-extern int dequeue(queue *q, char *item);
+extern int queue_check_size(unsigned int *size);
+extern int queue_init_external(queue *q, queue_item *items, queue_index *idx, unsigned int size);
+extern void queue_free(queue *q);
+extern int queue_move(queue *q, queue_item *items, queue_index *idx, unsigned int size);
+extern int enqueue_bulk(queue *q, const queue_item *items, unsigned int n);
+extern int dequeue_bulk_until(queue *q, queue_item *items, unsigned int n, u64 limit_ns);
+extern int queue_peek(queue *q, queue_item *item);
+extern unsigned int queue_depth(queue *q);
+extern int queue_is_empty(queue *q);
+extern int queue_is_full(queue *q);
 extern void queue_empty(queue *q);
 
 static char *keymap = NULL;
 module_param(keymap, charp, 0444);
 MODULE_PARM_DESC(keymap, "String of keypad characters");
 
+static unsigned int queue_size = QUEUE_SIZE;
+module_param(queue_size, uint, 0444);
+MODULE_PARM_DESC(queue_size, "Initial per-CPU keypad queue size, rounded up to a power of two");
+
+/*
+ * Readers sleep here until a producer publishes keys; writers polling for
+ * EPOLLOUT are woken when a reader frees space. Both sides only touch the
+ * wait queue lock when someone is actually sleeping.
+ */
+static DECLARE_WAIT_QUEUE_HEAD(keypad_wq);
+
+static void keypad_wake(void)
+{
+    if (wq_has_sleeper(&keypad_wq))
+        wake_up_interruptible(&keypad_wq);
+}
+
+/* Called on the owning CPU with interrupts disabled */
+static void keypad_account(struct keypad_cpu_queue *cq, unsigned int wanted, unsigned int put)
+{
+    unsigned int depth;
+
+    if (put < wanted)
+        cq->drops += wanted - put;
+
+    /* A mapping process owns tail, so don't trust it beyond the ring size */
+    depth = min(queue_depth(&cq->q), cq->q.size);
+    if (depth > cq->high_water)
+        cq->high_water = depth;
+}
+
+/*
+ * Stamp and enqueue n events on this CPU's ring, taking code/type from
+ * either a key string (all presses) or caller-supplied events. Every event
+ * gets a sequence number, including dropped ones, so readers see the gap.
+ * Returns how many fit. Doesn't sleep, so it may be called from interrupts.
+ */
+static int keypad_stamp_and_enqueue(const char *keys, const struct keypad_event *evs,
+                                    unsigned int n)
+{
+    queue_item batch[KEYPAD_STAMP_BATCH];
+    struct keypad_cpu_queue *cq;
+    unsigned int done = 0;
+    unsigned long flags;
+    bool frozen;
+    u64 ts_ns;
+    u32 seq;
+    u16 cpu;
+
+    rcu_read_lock();
+    local_irq_save(flags);
+    cq = this_cpu_ptr(cpu_queues);
+    cpu = smp_processor_id();
+    seq = cq->seq;
+
+    /* Pairs with the release in keypad_resize_queue(), so the moved rings are seen */
+    frozen = smp_load_acquire(&rings_frozen);
+
+    ts_ns = ktime_get_ns();
+    while (!frozen && done < n)
+    {
+        unsigned int chunk = min_t(unsigned int, n - done, KEYPAD_STAMP_BATCH);
+        unsigned int i;
+        int put;
+
+        for (i = 0; i < chunk; i++)
+        {
+            queue_item *ev = &batch[i];
+
+            ev->ts_ns = ts_ns;
+            ev->seq = seq + done + i;
+            ev->cpu = cpu;
+            if (keys)
+            {
+                ev->type = KEYPAD_EV_PRESS;
+                ev->code = keys[done + i];
+            }
+            else
+            {
+                ev->type = evs[done + i].type;
+                ev->code = evs[done + i].code;
+            }
+        }
+        put = enqueue_bulk(&cq->q, batch, chunk);
+        done += put;
+        if (put < chunk)
+            break;
+    }
+    cq->seq = seq + n;
+    if (frozen)
+        cq->drops += n;
+    else
+        keypad_account(cq, n, done);
+
+    local_irq_restore(flags);
+    rcu_read_unlock();
+    if (done)
+        keypad_wake();
+    return done;
+}
+
+/* Inject n key presses; returns how many fit in this CPU's queue */
+int keypad_inject_events(const char *keys, unsigned int n)
+{
+    return keypad_stamp_and_enqueue(keys, NULL, n);
+}
+EXPORT_SYMBOL(keypad_inject_events);
+
 void keypad_inject_event(char key)
 {
-    enqueue(&keyQueue, key);
+    keypad_inject_events(&key, 1);
 }
 EXPORT_SYMBOL(keypad_inject_event);
 
-void keypad_get_event(char *key)
+/*
+ * Inject typed events; only code and type are taken from evs, the time
+ * stamp, sequence number and CPU are filled in here.
+ */
+int keypad_report_events(const struct keypad_event *evs, unsigned int n)
 {
-    dequeue(&keyQueue, key);
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (evs[i].type != KEYPAD_EV_PRESS && evs[i].type != KEYPAD_EV_RELEASE)
+            return -EINVAL;
+    }
+    return keypad_stamp_and_enqueue(NULL, evs, n);
+}
+EXPORT_SYMBOL(keypad_report_events);
+
+/*
+ * k-way merge of the per-CPU rings. Each pass finds the ring with the
+ * oldest head and takes its whole run up to the next-oldest head, so a
+ * single busy CPU drains in one batch. Called as the consumer.
+ */
+static int keypad_merge(queue_item *items, unsigned int n)
+{
+    unsigned int got = 0;
+
+    while (got < n)
+    {
+        struct keypad_cpu_queue *oldest = NULL;
+        u64 oldest_ts = U64_MAX;
+        u64 next_ts = U64_MAX;
+        queue_item head;
+        int cpu;
+
+        for_each_possible_cpu(cpu)
+        {
+            struct keypad_cpu_queue *cq = per_cpu_ptr(cpu_queues, cpu);
+
+            if (queue_peek(&cq->q, &head))
+                continue;
+            if (head.ts_ns < oldest_ts)
+            {
+                next_ts = oldest_ts;
+                oldest_ts = head.ts_ns;
+                oldest = cq;
+            }
+            else if (head.ts_ns < next_ts)
+            {
+                next_ts = head.ts_ns;
+            }
+        }
+        if (!oldest)
+            break;
+
+        got += dequeue_bulk_until(&oldest->q, items + got, n - got, next_ts);
+    }
+    return got;
+}
+
+/*
+ * Returns how many events (up to n) were taken off the queues, oldest
+ * first, or -EBUSY while user space consumes them through mmap().
+ */
+int keypad_get_events(queue_item *items, unsigned int n)
+{
+    int got;
+
+    percpu_down_read(&resize_sem);
+    spin_lock(&consumer_lock);
+    if (atomic_read(&mmap_count))
+        got = -EBUSY;
+    else
+        got = keypad_merge(items, n);
+    spin_unlock(&consumer_lock);
+    percpu_up_read(&resize_sem);
+    if (got > 0)
+        keypad_wake();
+    return got;
+}
+EXPORT_SYMBOL(keypad_get_events);
+
+/* Returns 0 and fills *ev, or -1 when the queue is empty */
+int keypad_get_event(struct keypad_event *ev)
+{
+    if (keypad_get_events(ev, 1) <= 0)
+        return -1;
+    return 0;
 }
 EXPORT_SYMBOL(keypad_get_event);
 
-void keypad_clear_queue(void)
+/*
+ * Queue state checks for wait conditions and poll. These can't sleep, so a
+ * resize in progress reads as "ready" and the caller simply retries.
+ */
+static bool keypad_readable(void)
 {
-   queue_empty(&keyQueue);
+    bool ret = true;
+    int cpu;
+
+    if (percpu_down_read_trylock(&resize_sem))
+    {
+        ret = false;
+        for_each_possible_cpu(cpu)
+        {
+            if (!queue_is_empty(&per_cpu_ptr(cpu_queues, cpu)->q))
+            {
+                ret = true;
+                break;
+            }
+        }
+        percpu_up_read(&resize_sem);
+    }
+    return ret;
+}
+
+/* A writer lands on whatever CPU it runs on; judge by the local ring */
+static bool keypad_writable(void)
+{
+    bool ret = true;
+
+    if (percpu_down_read_trylock(&resize_sem))
+    {
+        ret = !queue_is_full(&raw_cpu_ptr(cpu_queues)->q);
+        percpu_up_read(&resize_sem);
+    }
+    return ret;
+}
+
+/*
+ * Blocking variant of keypad_get_events(): sleeps until at least one key
+ * is available. Returns -EAGAIN for nonblock callers on an empty queue and
+ * -ERESTARTSYS if interrupted by a signal.
+ */
+int keypad_read_events(queue_item *items, unsigned int n, bool nonblock)
+{
+    int got;
+
+    for (;;)
+    {
+        got = keypad_get_events(items, n);
+        if (got)
+            return got;
+        if (nonblock)
+            return -EAGAIN;
+        if (wait_event_interruptible(keypad_wq, keypad_readable()))
+            return -ERESTARTSYS;
+    }
+}
+EXPORT_SYMBOL(keypad_read_events);
+
+__poll_t keypad_poll(struct file *file, poll_table *wait)
+{
+    __poll_t mask = 0;
+
+    poll_wait(file, &keypad_wq, wait);
+
+    if (keypad_readable())
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (keypad_writable())
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+EXPORT_SYMBOL(keypad_poll);
+
+int keypad_clear_queue(void)
+{
+    int ret = 0;
+    int cpu;
+
+    percpu_down_read(&resize_sem);
+    spin_lock(&consumer_lock);
+    if (atomic_read(&mmap_count))
+        ret = -EBUSY;
+    else
+        for_each_possible_cpu(cpu)
+            queue_empty(&per_cpu_ptr(cpu_queues, cpu)->q);
+    spin_unlock(&consumer_lock);
+    percpu_up_read(&resize_sem);
+    keypad_wake();
+    return ret;
 }
 EXPORT_SYMBOL(keypad_clear_queue);
 
+/* Where CPU cpu's index and events sit inside a ring area */
+static queue_index *area_index(void *area, int cpu)
+{
+    struct keypad_mmap_info *info = area;
+
+    return (queue_index *)(area + info->index_offset) + cpu;
+}
+
+static queue_item *area_ring(void *area, int cpu)
+{
+    struct keypad_mmap_info *info = area;
+
+    return area + info->data_offset + (size_t)cpu * info->ring_stride;
+}
+
+/* Zeroed, mappable area for nr_cpu_ids rings of size events, header filled in */
+static void *keypad_area_alloc(unsigned int size, size_t *len)
+{
+    struct keypad_mmap_info info;
+    void *area;
+
+    info.nr_rings = nr_cpu_ids;
+    info.ring_size = size;
+    info.index_offset = ALIGN(sizeof(info), sizeof(queue_index));
+    info.data_offset = PAGE_ALIGN(info.index_offset + nr_cpu_ids * sizeof(queue_index));
+    info.ring_stride = size * sizeof(queue_item);
+    *len = PAGE_ALIGN(info.data_offset + (size_t)nr_cpu_ids * info.ring_stride);
+
+    area = vmalloc_user(*len);
+    if (area)
+        memcpy(area, &info, sizeof(info));
+    return area;
+}
+
+/*
+ * Resize every per-CPU ring at runtime; pending keys are carried over in
+ * order into a new area. Nothing is touched if any ring holds more than
+ * the new size, or while the rings are mapped.
+ */
+int keypad_resize_queue(unsigned int size)
+{
+    void *area = NULL;
+    size_t len;
+    int ret;
+    int cpu;
+
+    ret = queue_check_size(&size);
+    if (ret)
+        return ret;
+
+    percpu_down_write(&resize_sem);
+    ret = atomic_read(&mmap_count) ? -EBUSY : 0;
+    if (!ret)
+    {
+        area = keypad_area_alloc(size, &len);
+        if (!area)
+            ret = -ENOMEM;
+    }
+    if (!ret)
+    {
+        /* Stop the producers and wait for any still enqueueing */
+        WRITE_ONCE(rings_frozen, true);
+        synchronize_rcu();
+        for_each_possible_cpu(cpu)
+        {
+            if (queue_depth(&per_cpu_ptr(cpu_queues, cpu)->q) > size)
+            {
+                ret = -EBUSY;
+                break;
+            }
+        }
+    }
+    if (!ret)
+    {
+        for_each_possible_cpu(cpu)
+            queue_move(&per_cpu_ptr(cpu_queues, cpu)->q, area_ring(area, cpu),
+                       area_index(area, cpu), size);
+        vfree(ring_area);
+        ring_area = area;
+        ring_area_len = len;
+        queue_size = size;
+    }
+    else
+        vfree(area);
+    smp_store_release(&rings_frozen, false);
+    percpu_up_write(&resize_sem);
+
+    /* Sleepers may have seen the old rings as empty or full */
+    wake_up_interruptible(&keypad_wq);
+    if (!ret)
+        pr_info("Helper Driver: per-CPU queues resized to %u\n", queue_size);
+    return ret;
+}
+EXPORT_SYMBOL(keypad_resize_queue);
+
+static void keypad_vm_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&mmap_count);
+}
+
+/*
+ * Last unmap hands the rings back to in-kernel readers. Tails were written
+ * by user space, so any that no longer make sense are reset to empty.
+ */
+static void keypad_vm_close(struct vm_area_struct *vma)
+{
+    int cpu;
+
+    percpu_down_read(&resize_sem);
+    spin_lock(&consumer_lock);
+    if (atomic_dec_and_test(&mmap_count))
+    {
+        for_each_possible_cpu(cpu)
+        {
+            queue *q = &per_cpu_ptr(cpu_queues, cpu)->q;
+
+            if (queue_depth(q) > q->size)
+                smp_store_release(&q->idx->tail, READ_ONCE(q->idx->head));
+        }
+    }
+    spin_unlock(&consumer_lock);
+    percpu_up_read(&resize_sem);
+    keypad_wake();
+}
+
+static const struct vm_operations_struct keypad_vm_ops = {
+    .open = keypad_vm_open,
+    .close = keypad_vm_close,
+};
+
+/*
+ * Map the ring area (header, indexes and events) into user space, which
+ * then becomes the consumer of every ring: only one mapping at a time, not
+ * inherited across fork(). Producers still wake poll() sleepers, so the
+ * mapping process only needs a syscall once every ring is empty.
+ */
+int keypad_mmap(struct vm_area_struct *vma)
+{
+    int ret = 0;
+
+    if (vma->vm_pgoff)
+        return -EINVAL;
+
+    percpu_down_read(&resize_sem);
+    /* Under consumer_lock so no in-kernel reader is mid-merge */
+    spin_lock(&consumer_lock);
+    if (atomic_cmpxchg(&mmap_count, 0, 1))
+        ret = -EBUSY;
+    spin_unlock(&consumer_lock);
+
+    if (!ret)
+    {
+        ret = remap_vmalloc_range(vma, ring_area, 0);
+        if (ret)
+        {
+            atomic_set(&mmap_count, 0);
+        }
+        else
+        {
+            vma->vm_flags |= VM_DONTCOPY;
+            vma->vm_ops = &keypad_vm_ops;
+        }
+    }
+    percpu_up_read(&resize_sem);
+    return ret;
+}
+EXPORT_SYMBOL(keypad_mmap);
+
+static void keypad_free_queues(void)
+{
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        queue_free(&per_cpu_ptr(cpu_queues, cpu)->q);
+    free_percpu(cpu_queues);
+    vfree(ring_area);
+}
+
+static int keypad_alloc_queues(void)
+{
+    int ret;
+    int cpu;
+
+    ret = queue_check_size(&queue_size);
+    if (ret)
+        return ret;
+
+    cpu_queues = alloc_percpu(struct keypad_cpu_queue);
+    if (!cpu_queues)
+        return -ENOMEM;
+    ring_area = keypad_area_alloc(queue_size, &ring_area_len);
+    if (!ring_area)
+    {
+        free_percpu(cpu_queues);
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+        queue_init_external(&per_cpu_ptr(cpu_queues, cpu)->q, area_ring(ring_area, cpu),
+                            area_index(ring_area, cpu), queue_size);
+    return 0;
+}
+
+static ssize_t size_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%u\n", READ_ONCE(queue_size));
+}
+
+static ssize_t depth_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    unsigned int depth = 0;
+    int cpu;
+
+    percpu_down_read(&resize_sem);
+    for_each_possible_cpu(cpu)
+        depth += queue_depth(&per_cpu_ptr(cpu_queues, cpu)->q);
+    percpu_up_read(&resize_sem);
+    return sprintf(buf, "%u\n", depth);
+}
+
+/* Deepest any single ring has been, which is what queue_size must cover */
+static ssize_t high_water_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    unsigned int high_water = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        high_water = max(high_water, READ_ONCE(per_cpu_ptr(cpu_queues, cpu)->high_water));
+    return sprintf(buf, "%u\n", high_water);
+}
+
+static ssize_t drops_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    unsigned long drops = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        drops += READ_ONCE(per_cpu_ptr(cpu_queues, cpu)->drops);
+    return sprintf(buf, "%lu\n", drops);
+}
+
+static struct kobj_attribute size_attr = __ATTR(size, 0444, size_show, NULL);
+static struct kobj_attribute depth_attr = __ATTR(depth, 0444, depth_show, NULL);
+static struct kobj_attribute high_water_attr = __ATTR(high_water, 0444, high_water_show, NULL);
+static struct kobj_attribute drops_attr = __ATTR(drops, 0444, drops_show, NULL);
+
+static struct attribute *keypad_attrs[] = {
+    &size_attr.attr,
+    &depth_attr.attr,
+    &high_water_attr.attr,
+    &drops_attr.attr,
+    NULL,
+};
+
+static struct attribute_group keypad_attr_group = {
+    .attrs = keypad_attrs,
+};
+
+static struct kobject *keypad_kobj;
+
 static int __init keypad_init(void)
 {
 	int i;
-	
-    queue_init(&keyQueue);
-    printk(KERN_INFO "Helper Driver: Keypad Queue - Loaded");
-	
+	int ret;
+
+    ret = keypad_alloc_queues();
+    if (ret)
+        return ret;
+
+    keypad_kobj = kobject_create_and_add("keypad_queue", kernel_kobj);
+    if (!keypad_kobj)
+    {
+        keypad_free_queues();
+        return -ENOMEM;
+    }
+    ret = sysfs_create_group(keypad_kobj, &keypad_attr_group);
+    if (ret)
+    {
+        kobject_put(keypad_kobj);
+        keypad_free_queues();
+        return ret;
+    }
+    printk(KERN_INFO "Helper Driver: Keypad Queue - Loaded (%u per CPU)\n", queue_size);
+
     if (keymap)
 	{
-        for (i = 0; keymap[i]; i++) 
-		{
-            enqueue(&keyQueue, keymap[i]);
-            printk(KERN_INFO "Helper Driver: Enqueued param key %c\n", keymap[i]);
-        }
-    } 
-	else 
+        i = keypad_inject_events(keymap, strlen(keymap));
+        printk(KERN_INFO "Helper Driver: Enqueued %d of %zu param keys\n", i, strlen(keymap));
+    }
+	else
 	{
         printk(KERN_INFO "Helper Driver: No keymap provided\n");
     }
@@ -56,6 +669,8 @@ static int __init keypad_init(void)
 
 static void __exit keypad_exit(void)
 {
+    kobject_put(keypad_kobj);
+    keypad_free_queues();
     printk(KERN_INFO "Helper Driver: Keypad Queue - Unloaded");
 }
 
@@ -0,0 +1,240 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/sched.h>
+#include "queue_kernel.h"
+
+/*
+ * Stress benchmark: N producer kthreads push into one ring while a single
+ * consumer kthread drains it. Each configuration is run for 1..max_producers
+ * and the result is printed as ops/sec.
+ */
+
+#define BENCH_MAX_PRODUCERS 64
+
+static int max_producers = 4;
+module_param(max_producers, int, 0444);
+MODULE_PARM_DESC(max_producers, "Run with 1..max_producers producer threads");
+
+static unsigned long ops_per_producer = 1 << 20;
+module_param(ops_per_producer, ulong, 0444);
+MODULE_PARM_DESC(ops_per_producer, "Items each producer enqueues per run");
+
+/* Reference: the previous spinlocked ring with modulo indexing */
+typedef struct
+{
+    queue_item items[QUEUE_SIZE];
+    int front;
+    int rear;
+    int count;
+    spinlock_t lock;
+} locked_queue;
+
+static int locked_enqueue(locked_queue *q, queue_item item)
+{
+    int ret = 0;
+    spin_lock(&q->lock);
+
+    if (q->count == QUEUE_SIZE) {
+        ret = -1;
+    } else {
+        q->items[q->rear] = item;
+        q->rear = (q->rear + 1) % QUEUE_SIZE;
+        q->count++;
+    }
+
+    spin_unlock(&q->lock);
+    return ret;
+}
+
+static int locked_dequeue(locked_queue *q, queue_item *item)
+{
+    int ret = 0;
+    spin_lock(&q->lock);
+
+    if (q->count == 0) {
+        ret = -1;
+    } else {
+        *item = q->items[q->front];
+        q->front = (q->front + 1) % QUEUE_SIZE;
+        q->count--;
+    }
+
+    spin_unlock(&q->lock);
+    return ret;
+}
+
+enum bench_impl
+{
+    BENCH_LOCKED,
+    BENCH_SPSC,
+    BENCH_MPSC
+};
+
+static const char * const bench_names[] = {
+    [BENCH_LOCKED] = "spinlock",
+    [BENCH_SPSC]   = "spsc",
+    [BENCH_MPSC]   = "mpsc",
+};
+
+static struct
+{
+    enum bench_impl impl;
+    locked_queue lq;
+    queue lfq;
+    unsigned long total;
+    atomic_t threads_left;
+    struct completion done;
+} bench;
+
+static int bench_push(queue_item item)
+{
+    if (bench.impl == BENCH_LOCKED)
+        return locked_enqueue(&bench.lq, item);
+    return enqueue(&bench.lfq, item);
+}
+
+static int bench_pop(queue_item *item)
+{
+    if (bench.impl == BENCH_LOCKED)
+        return locked_dequeue(&bench.lq, item);
+    return dequeue(&bench.lfq, item);
+}
+
+static void bench_thread_done(void)
+{
+    if (atomic_dec_and_test(&bench.threads_left))
+        complete(&bench.done);
+}
+
+static int producer_fn(void *data)
+{
+    queue_item item = { .type = KEYPAD_EV_PRESS };
+    unsigned long i;
+
+    for (i = 0; i < ops_per_producer; i++)
+    {
+        item.code = (u8)i;
+        while (bench_push(item) < 0)
+        {
+            cpu_relax();
+            cond_resched();
+        }
+    }
+    bench_thread_done();
+    return 0;
+}
+
+static int consumer_fn(void *data)
+{
+    unsigned long got = 0;
+    queue_item item;
+
+    while (got < bench.total)
+    {
+        if (bench_pop(&item) == 0)
+        {
+            got++;
+            continue;
+        }
+        cpu_relax();
+        cond_resched();
+    }
+    bench_thread_done();
+    return 0;
+}
+
+static int bench_run(enum bench_impl impl, int producers)
+{
+    struct task_struct *tasks[BENCH_MAX_PRODUCERS + 1];
+    int nr_tasks = 0;
+    ktime_t start;
+    u64 ns;
+    int ret;
+    int i;
+
+    bench.impl = impl;
+    bench.total = ops_per_producer * producers;
+    bench.lq.front = bench.lq.rear = bench.lq.count = 0;
+    spin_lock_init(&bench.lq.lock);
+    ret = queue_init_mode(&bench.lfq, impl == BENCH_SPSC ? QUEUE_SPSC : QUEUE_MPSC);
+    if (ret)
+        return ret;
+    init_completion(&bench.done);
+    atomic_set(&bench.threads_left, producers + 1);
+
+    /* Create everything first so all threads start together */
+    for (i = 0; i <= producers; i++)
+    {
+        if (i == 0)
+            tasks[nr_tasks] = kthread_create(consumer_fn, NULL, "qbench_cons");
+        else
+            tasks[nr_tasks] = kthread_create(producer_fn, NULL, "qbench_prod%d", i - 1);
+        if (IS_ERR(tasks[nr_tasks]))
+        {
+            ret = PTR_ERR(tasks[nr_tasks]);
+            while (nr_tasks--)
+                kthread_stop(tasks[nr_tasks]);
+            queue_free(&bench.lfq);
+            return ret;
+        }
+        nr_tasks++;
+    }
+
+    start = ktime_get();
+    for (i = 0; i < nr_tasks; i++)
+        wake_up_process(tasks[i]);
+    wait_for_completion(&bench.done);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    queue_free(&bench.lfq);
+
+    pr_info("queueBench: %-8s producers=%d ops=%lu time=%llu us ops/sec=%llu\n",
+            bench_names[impl], producers, bench.total, ns / NSEC_PER_USEC,
+            ns ? div64_u64((u64)bench.total * NSEC_PER_SEC, ns) : 0);
+    return 0;
+}
+
+static int __init queue_bench_init(void)
+{
+    int n;
+    int ret;
+
+    if (max_producers < 1 || max_producers > BENCH_MAX_PRODUCERS)
+        return -EINVAL;
+
+    pr_info("queueBench: %lu ops per producer, up to %d producers\n",
+            ops_per_producer, max_producers);
+
+    ret = bench_run(BENCH_SPSC, 1);
+    if (ret)
+        return ret;
+
+    for (n = 1; n <= max_producers; n++)
+    {
+        ret = bench_run(BENCH_LOCKED, n);
+        if (ret)
+            return ret;
+        ret = bench_run(BENCH_MPSC, n);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+static void __exit queue_bench_exit(void)
+{
+    pr_info("queueBench: unloaded\n");
+}
+
+module_init(queue_bench_init);
+module_exit(queue_bench_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("SK AHMED");
+MODULE_DESCRIPTION("Lock-based vs lock-free keypad queue benchmark");
@@ -1,60 +1,462 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/init.h>
-#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <asm/barrier.h>
 #include "queue_kernel.h"
 
-void queue_init(queue *q)
+static int queue_alloc(unsigned int size, queue_item **items, unsigned int **seq)
 {
-    q->front = q->rear = q->count = 0;
-    spin_lock_init(&q->lock);
+    *items = kmalloc_array(size, sizeof(**items), GFP_KERNEL);
+    *seq = kmalloc_array(size, sizeof(**seq), GFP_KERNEL);
+    if (!*items || !*seq)
+    {
+        kfree(*items);
+        kfree(*seq);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Round a requested size to the power of two the masking needs */
+int queue_check_size(unsigned int *size)
+{
+    if (*size < 2 || *size > QUEUE_MAX_SIZE)
+        return -EINVAL;
+    *size = roundup_pow_of_two(*size);
+    return 0;
+}
+EXPORT_SYMBOL(queue_check_size);
+
+/* Point q at fresh storage holding the first n items already in place */
+static void queue_install(queue *q, queue_item *items, unsigned int *seq,
+                          queue_index *idx, unsigned int size, unsigned int n)
+{
+    unsigned int i;
+
+    q->items = items;
+    q->seq = seq;
+    q->idx = idx;
+    q->size = size;
+    q->mask = size - 1;
+    q->idx->head = n;
+    q->idx->tail = 0;
+    for (i = 0; seq && i < size; i++)
+        q->seq[i] = i < n ? i + 1 : i;
+}
+
+int queue_init_size(queue *q, queue_mode mode, unsigned int size)
+{
+    queue_item *items;
+    unsigned int *seq;
+    int ret;
+
+    ret = queue_check_size(&size);
+    if (ret)
+        return ret;
+    ret = queue_alloc(size, &items, &seq);
+    if (ret)
+        return ret;
+
+    q->mode = mode;
+    q->external = false;
+    queue_install(q, items, seq, &q->own_idx, size, 0);
+    return 0;
+}
+EXPORT_SYMBOL(queue_init_size);
+
+/*
+ * SPSC ring over caller-owned storage, e.g. memory also mapped into user
+ * space. size must already be a power of two; queue_free() leaves items
+ * and idx alone.
+ */
+int queue_init_external(queue *q, queue_item *items, queue_index *idx, unsigned int size)
+{
+    if (!is_power_of_2(size) || size < 2 || size > QUEUE_MAX_SIZE)
+        return -EINVAL;
+
+    q->mode = QUEUE_SPSC;
+    q->external = true;
+    queue_install(q, items, NULL, idx, size, 0);
+    return 0;
+}
+EXPORT_SYMBOL(queue_init_external);
+
+int queue_init_mode(queue *q, queue_mode mode)
+{
+    return queue_init_size(q, mode, QUEUE_SIZE);
+}
+EXPORT_SYMBOL(queue_init_mode);
+
+/* Default is MPSC: any number of writers may inject keys concurrently */
+int queue_init(queue *q)
+{
+    return queue_init_mode(q, QUEUE_MPSC);
 }
 EXPORT_SYMBOL(queue_init);
 
-int enqueue(queue *q, char item)
+void queue_free(queue *q)
+{
+    if (!q->external)
+    {
+        kfree(q->items);
+        kfree(q->seq);
+    }
+    q->items = NULL;
+    q->seq = NULL;
+}
+EXPORT_SYMBOL(queue_free);
+
+static int enqueue_spsc(queue *q, queue_item item)
+{
+    unsigned int head = q->idx->head;
+    unsigned int tail = smp_load_acquire(&q->idx->tail);
+
+    if (head - tail >= q->size)
+        return -1;
+
+    q->items[head & q->mask] = item;
+    /* Publish the item before the consumer can see the new head */
+    smp_store_release(&q->idx->head, head + 1);
+    return 0;
+}
+
+static int enqueue_mpsc(queue *q, queue_item item)
 {
-    int ret = 0;
-    spin_lock(&q->lock);
+    unsigned int pos = READ_ONCE(q->idx->head);
+    unsigned int slot;
+
+    for (;;)
+    {
+        int diff;
 
-    if (q->count == QUEUE_SIZE) {
-        ret = -1;
-    } else {
-        q->items[q->rear] = item;
-        q->rear = (q->rear + 1) % QUEUE_SIZE;
-        q->count++;
+        slot = pos & q->mask;
+        diff = (int)(smp_load_acquire(&q->seq[slot]) - pos);
+
+        if (diff == 0)
+        {
+            /* Slot is free for pos: claim it */
+            unsigned int old = cmpxchg(&q->idx->head, pos, pos + 1);
+            if (old == pos)
+                break;
+            pos = old;
+        }
+        else if (diff < 0)
+        {
+            return -1;	/* consumer has not released this slot yet: full */
+        }
+        else
+        {
+            pos = READ_ONCE(q->idx->head);	/* lost the race, retry */
+        }
     }
 
-    spin_unlock(&q->lock);
-    return ret;
+    q->items[slot] = item;
+    smp_store_release(&q->seq[slot], pos + 1);
+    return 0;
+}
+
+int enqueue(queue *q, queue_item item)
+{
+    if (q->mode == QUEUE_SPSC)
+        return enqueue_spsc(q, item);
+    return enqueue_mpsc(q, item);
 }
 EXPORT_SYMBOL(enqueue);
 
-int dequeue(queue *q, char *item)
+static int dequeue_spsc(queue *q, queue_item *item)
 {
-    int ret = 0;
-    spin_lock(&q->lock);
+    unsigned int tail = q->idx->tail;
+    unsigned int head = smp_load_acquire(&q->idx->head);
 
-    if (q->count == 0) {
-        ret = -1;
-    } else {
-        *item = q->items[q->front];
-        q->front = (q->front + 1) % QUEUE_SIZE;
-        q->count--;
-    }
+    if (head == tail)
+        return -1;
+
+    *item = q->items[tail & q->mask];
+    /* Item is copied out before the producer may reuse the slot */
+    smp_store_release(&q->idx->tail, tail + 1);
+    return 0;
+}
+
+static int dequeue_mpsc(queue *q, queue_item *item)
+{
+    unsigned int pos = q->idx->tail;
+    unsigned int slot = pos & q->mask;
 
-    spin_unlock(&q->lock);
-    return ret;
+    /* Empty, or a producer claimed the slot but has not filled it yet */
+    if (smp_load_acquire(&q->seq[slot]) != pos + 1)
+        return -1;
+
+    *item = q->items[slot];
+    smp_store_release(&q->seq[slot], pos + q->size);
+    /* Release: bulk producers size their claim from tail alone */
+    smp_store_release(&q->idx->tail, pos + 1);
+    return 0;
+}
+
+/* Single consumer only: callers serialize dequeue() among themselves */
+int dequeue(queue *q, queue_item *item)
+{
+    if (q->mode == QUEUE_SPSC)
+        return dequeue_spsc(q, item);
+    return dequeue_mpsc(q, item);
 }
 EXPORT_SYMBOL(dequeue);
 
+/* Copy n items into the ring at pos, handling the wrap in two pieces */
+static void ring_copy_in(queue *q, unsigned int pos, const queue_item *src, unsigned int n)
+{
+    unsigned int off = pos & q->mask;
+    unsigned int first = min_t(unsigned int, n, q->size - off);
+
+    memcpy(q->items + off, src, first * sizeof(*src));
+    memcpy(q->items, src + first, (n - first) * sizeof(*src));
+}
+
+static void ring_copy_out(queue *q, unsigned int pos, queue_item *dst, unsigned int n)
+{
+    unsigned int off = pos & q->mask;
+    unsigned int first = min_t(unsigned int, n, q->size - off);
+
+    memcpy(dst, q->items + off, first * sizeof(*dst));
+    memcpy(dst + first, q->items, (n - first) * sizeof(*dst));
+}
+
+/*
+ * Enqueue up to n items with a single index update. Returns how many were
+ * queued, which is less than n when the ring fills up.
+ */
+int enqueue_bulk(queue *q, const queue_item *items, unsigned int n)
+{
+    unsigned int pos;
+    unsigned int i;
+
+    if (q->mode == QUEUE_SPSC)
+    {
+        unsigned int used;
+
+        /* >= rather than ==: an external tail may be written by user space */
+        pos = q->idx->head;
+        used = pos - smp_load_acquire(&q->idx->tail);
+        if (used >= q->size)
+            return 0;
+        n = min_t(unsigned int, n, q->size - used);
+        ring_copy_in(q, pos, items, n);
+        smp_store_release(&q->idx->head, pos + n);
+        return n;
+    }
+
+    /*
+     * MPSC: the consumer releases slots strictly in order, so everything
+     * below tail + size is free. Claim the whole run with one cmpxchg
+     * and publish each slot as it is filled.
+     */
+    pos = READ_ONCE(q->idx->head);
+    for (;;)
+    {
+        unsigned int room = q->size - (pos - smp_load_acquire(&q->idx->tail));
+        unsigned int want = min_t(unsigned int, n, room);
+        unsigned int old;
+
+        if (!want || room > q->size)
+        {
+            /* Full, or pos is stale and the subtraction wrapped */
+            unsigned int cur = READ_ONCE(q->idx->head);
+            if (!want && cur == pos)
+                return 0;
+            pos = cur;
+            continue;
+        }
+
+        old = cmpxchg(&q->idx->head, pos, pos + want);
+        if (old == pos)
+        {
+            n = want;
+            break;
+        }
+        pos = old;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned int slot = (pos + i) & q->mask;
+        q->items[slot] = items[i];
+        smp_store_release(&q->seq[slot], pos + i + 1);
+    }
+    return n;
+}
+EXPORT_SYMBOL(enqueue_bulk);
+
+/* Dequeue up to n items with a single index update; returns the count */
+int dequeue_bulk(queue *q, queue_item *items, unsigned int n)
+{
+    unsigned int pos = q->idx->tail;
+    unsigned int i;
+
+    if (q->mode == QUEUE_SPSC)
+    {
+        n = min_t(unsigned int, n, smp_load_acquire(&q->idx->head) - pos);
+        if (!n)
+            return 0;
+        ring_copy_out(q, pos, items, n);
+        smp_store_release(&q->idx->tail, pos + n);
+        return n;
+    }
+
+    /* MPSC: stop at the first slot a producer has not published yet */
+    for (i = 0; i < n; i++)
+    {
+        unsigned int slot = (pos + i) & q->mask;
+        if (smp_load_acquire(&q->seq[slot]) != pos + i + 1)
+            break;
+        items[i] = q->items[slot];
+        smp_store_release(&q->seq[slot], pos + i + q->size);
+    }
+    if (i)
+        smp_store_release(&q->idx->tail, pos + i);
+    return i;
+}
+EXPORT_SYMBOL(dequeue_bulk);
+
+/*
+ * Like dequeue_bulk(), but stop at the first item stamped after limit_ns. Used
+ * to merge several time-ordered queues: the consumer takes a whole run from
+ * the oldest queue up to the next-oldest head in one go.
+ */
+int dequeue_bulk_until(queue *q, queue_item *items, unsigned int n, u64 limit_ns)
+{
+    unsigned int pos = q->idx->tail;
+    unsigned int i;
+
+    if (q->mode == QUEUE_SPSC)
+        n = min_t(unsigned int, n, smp_load_acquire(&q->idx->head) - pos);
+
+    for (i = 0; i < n; i++)
+    {
+        unsigned int slot = (pos + i) & q->mask;
+
+        if (q->mode == QUEUE_MPSC &&
+            smp_load_acquire(&q->seq[slot]) != pos + i + 1)
+            break;
+        if (q->items[slot].ts_ns > limit_ns)
+            break;
+        items[i] = q->items[slot];
+        if (q->mode == QUEUE_MPSC)
+            smp_store_release(&q->seq[slot], pos + i + q->size);
+    }
+    if (i)
+        smp_store_release(&q->idx->tail, pos + i);
+    return i;
+}
+EXPORT_SYMBOL(dequeue_bulk_until);
+
+/* Copy the next item out without consuming it; -1 when empty */
+int queue_peek(queue *q, queue_item *item)
+{
+    unsigned int pos = q->idx->tail;
+    unsigned int slot = pos & q->mask;
+
+    if (q->mode == QUEUE_SPSC)
+    {
+        if (smp_load_acquire(&q->idx->head) == pos)
+            return -1;
+    }
+    else if (smp_load_acquire(&q->seq[slot]) != pos + 1)
+    {
+        return -1;
+    }
+
+    *item = q->items[slot];
+    return 0;
+}
+EXPORT_SYMBOL(queue_peek);
+
+/*
+ * Grow or shrink the ring, carrying pending items over in order. Fails with
+ * -EBUSY rather than drop anything if they would not fit. The caller must
+ * keep every producer and the consumer out while this runs.
+ */
+int queue_resize(queue *q, unsigned int size)
+{
+    queue_item *items;
+    unsigned int *seq;
+    unsigned int n;
+    int ret;
+
+    if (q->external)
+        return -EINVAL;
+    ret = queue_check_size(&size);
+    if (ret)
+        return ret;
+    if (queue_depth(q) > size)
+        return -EBUSY;
+
+    ret = queue_alloc(size, &items, &seq);
+    if (ret)
+        return ret;
+
+    n = dequeue_bulk(q, items, size);
+    queue_free(q);
+    queue_install(q, items, seq, &q->own_idx, size, n);
+    return 0;
+}
+EXPORT_SYMBOL(queue_resize);
+
+/*
+ * queue_resize() for external queues: carry pending items over to new
+ * caller-owned storage. The old storage is the caller's to free afterwards.
+ */
+int queue_move(queue *q, queue_item *items, queue_index *idx, unsigned int size)
+{
+    unsigned int n;
+
+    if (!q->external || !is_power_of_2(size) || size < 2 || size > QUEUE_MAX_SIZE)
+        return -EINVAL;
+    if (queue_depth(q) > size)
+        return -EBUSY;
+
+    n = dequeue_bulk(q, items, size);
+    queue_install(q, items, NULL, idx, size, n);
+    return 0;
+}
+EXPORT_SYMBOL(queue_move);
+
+/* Claimed slots, including ones a producer is still filling */
+unsigned int queue_depth(queue *q)
+{
+    return READ_ONCE(q->idx->head) - READ_ONCE(q->idx->tail);
+}
+EXPORT_SYMBOL(queue_depth);
+
+/* Consumer view: is the next item published yet? */
+int queue_is_empty(queue *q)
+{
+    unsigned int pos = READ_ONCE(q->idx->tail);
+
+    if (q->mode == QUEUE_SPSC)
+        return smp_load_acquire(&q->idx->head) == pos;
+    return smp_load_acquire(&q->seq[pos & q->mask]) != pos + 1;
+}
+EXPORT_SYMBOL(queue_is_empty);
+
+/* Producer view: are all slots claimed? */
+int queue_is_full(queue *q)
+{
+    return READ_ONCE(q->idx->head) - smp_load_acquire(&q->idx->tail) >= q->size;
+}
+EXPORT_SYMBOL(queue_is_full);
+
+/* Consumer side: drain whatever is published, producers may keep running */
 void queue_empty(queue *q)
 {
-    char item;
-    while (dequeue(q, &item) == 0) 
-	{
-		
+    queue_item item;
+    while (dequeue(q, &item) == 0)
+    {
+
     }
-	q->front = q->rear = q->count = 0;
 }
 EXPORT_SYMBOL(queue_empty);
 
@@ -1,20 +1,63 @@
 #ifndef _QUEUE_H
 #define _QUEUE_H
 
-#define QUEUE_SIZE 64
+#include <linux/cache.h>
+#include "keypad_event.h"
 
+#define QUEUE_SIZE 64			/* default size, sizes are powers of two */
+#define QUEUE_MAX_SIZE (1 << 20)
+
+typedef enum
+{
+    QUEUE_SPSC,		/* one producer, one consumer: plain head/tail */
+    QUEUE_MPSC		/* many producers, one consumer: per-slot sequence */
+} queue_mode;
+
+/* Items carry their injection time (ts_ns), which orders merged queues */
+typedef struct keypad_event queue_item;
+
+/* head/tail pair, laid out so it can be shared with user space */
+typedef struct keypad_ring_index queue_index;
+
+/*
+ * Lock-free ring. head and tail are free-running counters that are only
+ * masked when indexing items[], so head - tail is always the depth.
+ * They live on separate cachelines so producers and the consumer don't
+ * bounce each other's line on every operation.
+ *
+ * items[] and seq[] are kmalloc'd and idx points at own_idx; queue_resize()
+ * swaps them and must not race with any enqueue/dequeue. An external queue
+ * runs SPSC on storage and an index owned by the caller instead.
+ */
 typedef struct
 {
-    char items[QUEUE_SIZE];
-    int front;
-    int rear;
-    int count;
-    spinlock_t lock;
+    queue_item *items;
+    unsigned int *seq;		/* MPSC only: slot ready for pos when seq == pos + 1 */
+    queue_index *idx;
+    unsigned int size;
+    unsigned int mask;
+    queue_mode mode;
+    bool external;
+    queue_index own_idx ____cacheline_aligned_in_smp;
 } queue;
 
-void queue_init(queue *q);
-int enqueue(queue *q, char item);
-int dequeue(queue *q, char *item);
+int queue_check_size(unsigned int *size);
+int queue_init(queue *q);
+int queue_init_mode(queue *q, queue_mode mode);
+int queue_init_size(queue *q, queue_mode mode, unsigned int size);
+int queue_init_external(queue *q, queue_item *items, queue_index *idx, unsigned int size);
+void queue_free(queue *q);
+int queue_resize(queue *q, unsigned int size);
+int queue_move(queue *q, queue_item *items, queue_index *idx, unsigned int size);
+int enqueue(queue *q, queue_item item);
+int dequeue(queue *q, queue_item *item);
+int enqueue_bulk(queue *q, const queue_item *items, unsigned int n);
+int dequeue_bulk(queue *q, queue_item *items, unsigned int n);
+int dequeue_bulk_until(queue *q, queue_item *items, unsigned int n, u64 limit_ns);
+int queue_peek(queue *q, queue_item *item);
+unsigned int queue_depth(queue *q);
+int queue_is_empty(queue *q);
+int queue_is_full(queue *q);
 void queue_empty(queue *q);
 
 #endif
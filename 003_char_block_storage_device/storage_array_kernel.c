@@ -0,0 +1,543 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include "storage_kernel.h"
+#include "storage_blk.h"
+
+/*
+ * Storage array: the sector store of storage_kernel.c is split into
+ * array_members equal member disks, /dev/vmember0.., and /dev/varray0
+ * stripes (level 0) or mirrors (level 1) over them in array_chunk_kb
+ * chunks. Each member has its own worker, so the chunks of a large
+ * request are copied on all members in parallel; requests to a member
+ * disk go through the same worker. Like vblk0, all of it shares the
+ * store's stripe and sector write locks, and all nodes alias the same
+ * sectors: don't mix buffered I/O on them.
+ */
+
+#define ARRAY_MAX_MEMBERS 8
+
+static unsigned int array_members = 4;
+module_param(array_members, uint, 0444);
+MODULE_PARM_DESC(array_members, "Member disks the store is split into (2-8)");
+
+static unsigned int array_level;
+module_param(array_level, uint, 0444);
+MODULE_PARM_DESC(array_level, "0 stripes across the members (RAID-0), 1 mirrors them (RAID-1)");
+
+static unsigned int array_chunk_kb = 64;
+module_param(array_chunk_kb, uint, 0444);
+MODULE_PARM_DESC(array_chunk_kb, "Chunk size (KB, power of two)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Requests in flight per hardware queue");
+
+struct array_member
+{
+    sector_t start;		/* first store sector */
+    struct workqueue_struct *wq;
+    struct gendisk *disk;	/* NULL until added */
+};
+
+/* One member's share of a request, run by that member's worker */
+struct array_io
+{
+    struct work_struct work;
+    struct request *rq;
+    unsigned int member;
+};
+
+/*
+ * Request PDU: members still busy, the first error any of them hit and,
+ * for a write, its segments, gathered once for all members.
+ */
+struct array_cmd
+{
+    atomic_t pending;
+    int error;		/* an errno, for cmpxchg() on any arch */
+    struct iov_iter iter;
+    struct bio_vec *bvec;	/* kfree()d by the last member */
+    struct array_io io[ARRAY_MAX_MEMBERS];
+};
+
+static int array_major;
+static struct blk_mq_tag_set array_tag_set;
+static struct array_member members[ARRAY_MAX_MEMBERS];
+static struct gendisk *array_disk;
+static sector_t member_sectors;
+static sector_t array_sectors;
+static unsigned int chunk_shift;
+
+/*
+ * Map sector s of the disk io was queued for onto io's member: its store
+ * sector, and in *len how many sectors from s on are contiguous there.
+ * False if the member doesn't hold s; *len then is the run to skip.
+ */
+static bool array_map(const struct array_io *io, sector_t s, bool write,
+                      sector_t *store, sector_t *len)
+{
+    sector_t start = members[io->member].start;
+    sector_t chunk = s >> chunk_shift;
+    u32 m;
+
+    *len = (1ULL << chunk_shift) - (s & ((1ULL << chunk_shift) - 1));
+
+    /* A member disk itself */
+    if (io->rq->q->queuedata)
+    {
+        *store = start + s;
+        *len = member_sectors - s;
+        return true;
+    }
+
+    if (array_level == 1)
+    {
+        /* Writes go to every copy, reads to one per chunk to spread them */
+        *store = start + s;
+        if (write)
+        {
+            *len = array_sectors - s;
+            return true;
+        }
+        div_u64_rem(chunk, array_members, &m);
+        return m == io->member;
+    }
+
+    chunk = div_u64_rem(chunk, array_members, &m);
+    *store = start + (chunk << chunk_shift) + (s & ((1ULL << chunk_shift) - 1));
+    return m == io->member;
+}
+
+/* Members holding any of rq's sectors */
+static unsigned long array_members_of(struct request *rq)
+{
+    sector_t s = blk_rq_pos(rq);
+    sector_t end = s + blk_rq_sectors(rq);
+    unsigned long mask = 0;
+    u32 m;
+
+    if (array_level == 1 && op_is_write(req_op(rq)))
+        return BIT(array_members) - 1;
+    /* Consecutive chunks cycle through the members, so this stops soon */
+    while (s < end && hweight_long(mask) < array_members)
+    {
+        div_u64_rem(s >> chunk_shift, array_members, &m);
+        mask |= BIT(m);
+        s = ((s >> chunk_shift) + 1) << chunk_shift;
+    }
+    return mask;
+}
+
+/*
+ * Level 1 read that failed its checksum on this member: read the other
+ * copies and rewrite this one from the first good copy.
+ */
+static int array_read_other(const struct array_io *io, sector_t store, void *p, unsigned int len)
+{
+    sector_t off = store - members[io->member].start;
+    sector_t last = store + (len >> STORAGE_SECTOR_SHIFT) - 1;
+    unsigned int m;
+    int ret = -EIO;
+
+    for (m = 0; m < array_members && ret; m++)
+    {
+        sector_t alt = members[m].start + off;
+
+        if (m == io->member)
+            continue;
+        storage_lock_range(alt, alt + (len >> STORAGE_SECTOR_SHIFT) - 1, false);
+        ret = storage_copy_out((loff_t)alt << STORAGE_SECTOR_SHIFT, p, len);
+        storage_unlock_range(alt, alt + (len >> STORAGE_SECTOR_SHIFT) - 1, false);
+    }
+    if (ret)
+        return ret;
+
+    storage_lock_range(store, last, true);
+    if (!storage_range_locked(store, last) &&
+        !storage_copy_in((loff_t)store << STORAGE_SECTOR_SHIFT, p, len))
+        pr_warn_ratelimited("storageArray: repaired sectors %llu-%llu of vmember%u\n",
+                            (unsigned long long)off,
+                            (unsigned long long)(off + (len >> STORAGE_SECTOR_SHIFT) - 1),
+                            io->member);
+    storage_unlock_range(store, last, true);
+    return 0;
+}
+
+/* Read len bytes at store sector store */
+static int array_read_run(const struct array_io *io, sector_t store, void *p, unsigned int len)
+{
+    sector_t last = store + (len >> STORAGE_SECTOR_SHIFT) - 1;
+    int ret;
+
+    storage_lock_range(store, last, false);
+    ret = storage_copy_out((loff_t)store << STORAGE_SECTOR_SHIFT, p, len);
+    storage_unlock_range(store, last, false);
+
+    if (ret == -EIO && array_level == 1 && !io->rq->q->queuedata)
+        ret = array_read_other(io, store, p, len);
+    return ret;
+}
+
+/* Walk every segment of a read, copying the runs on io's member */
+static int array_read(const struct array_io *io)
+{
+    struct request *rq = io->rq;
+    sector_t s = blk_rq_pos(rq);
+    struct req_iterator iter;
+    struct bio_vec bv;
+    int ret = 0;
+
+    rq_for_each_segment(bv, rq, iter)
+    {
+        unsigned char *p = bvec_kmap_local(&bv);
+        unsigned int off = 0;
+
+        while (!ret && off < bv.bv_len)
+        {
+            sector_t store, len;
+            bool mine = array_map(io, s, false, &store, &len);
+            unsigned int n = min_t(sector_t, len << STORAGE_SECTOR_SHIFT, bv.bv_len - off);
+
+            if (mine)
+                ret = array_read_run(io, store, p + off, n);
+            off += n;
+            s += n >> STORAGE_SECTOR_SHIFT;
+        }
+        kunmap_local(p);
+        if (ret)
+            break;
+    }
+    return ret;
+}
+
+/*
+ * Write the runs of a request on io's member, honouring the sector write
+ * locks. Each run goes in as one change, so the journal replays it whole;
+ * the runs on different members are separate changes.
+ */
+static int array_write(const struct array_io *io)
+{
+    struct request *rq = io->rq;
+    struct array_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct iov_iter whole = cmd->iter, from;
+    sector_t s = blk_rq_pos(rq);
+    sector_t end = s + blk_rq_sectors(rq);
+    int ret = 0;
+
+    while (!ret && s < end)
+    {
+        sector_t store, len;
+        bool mine = array_map(io, s, true, &store, &len);
+
+        len = min(len, end - s);
+        if (mine)
+        {
+            from = whole;
+            iov_iter_truncate(&from, len << STORAGE_SECTOR_SHIFT);
+            storage_lock_range(store, store + len - 1, true);
+            if (storage_range_locked(store, store + len - 1))
+                ret = -EIO;
+            else
+                ret = storage_copy_in_iter((loff_t)store << STORAGE_SECTOR_SHIFT, &from);
+            storage_unlock_range(store, store + len - 1, true);
+        }
+        iov_iter_advance(&whole, len << STORAGE_SECTOR_SHIFT);
+        s += len;
+    }
+    return ret;
+}
+
+/* Discard and write zeroes: erase the runs on io's member */
+static int array_erase(const struct array_io *io)
+{
+    sector_t s = blk_rq_pos(io->rq);
+    sector_t end = s + blk_rq_sectors(io->rq);
+    int ret = 0;
+
+    while (!ret && s < end)
+    {
+        sector_t store, len;
+        bool mine = array_map(io, s, true, &store, &len);
+
+        len = min(len, end - s);
+        if (mine)
+        {
+            storage_lock_range(store, store + len - 1, true);
+            if (storage_range_locked(store, store + len - 1))
+                ret = -EIO;
+            else
+                ret = storage_erase_range(store, store + len - 1);
+            storage_unlock_range(store, store + len - 1, true);
+        }
+        s += len;
+    }
+    return ret;
+}
+
+/*
+ * Member worker. The last member to finish a request ends it, after a
+ * journal flush for FUA. A write touching a locked sector fails, but the
+ * runs on other members may have been written, as on a real array.
+ */
+static void array_io_work(struct work_struct *work)
+{
+    struct array_io *io = container_of(work, struct array_io, work);
+    struct request *rq = io->rq;
+    struct array_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    unsigned int noio_flags;
+    int ret;
+
+    /* Sector allocation must not recurse into I/O */
+    noio_flags = memalloc_noio_save();
+    if (req_op(rq) == REQ_OP_DISCARD || req_op(rq) == REQ_OP_WRITE_ZEROES)
+        ret = array_erase(io);
+    else if (req_op(rq) == REQ_OP_WRITE)
+        ret = array_write(io);
+    else
+        ret = array_read(io);
+    memalloc_noio_restore(noio_flags);
+    /* Later errors don't overwrite the first */
+    if (ret)
+        cmpxchg(&cmd->error, 0, ret);
+
+    if (!atomic_dec_and_test(&cmd->pending))
+        return;
+    kfree(cmd->bvec);
+    if (!cmd->error && (rq->cmd_flags & REQ_FUA))
+        cmd->error = storage_flush();
+    blk_mq_end_request(rq, errno_to_blk_status(cmd->error));
+}
+
+/*
+ * Hand each member its share of the request. Flushes are served inline,
+ * they only wait for the store's journal, hence BLK_MQ_F_BLOCKING.
+ */
+static blk_status_t array_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+    struct request *rq = bd->rq;
+    struct array_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct array_member *member = rq->q->queuedata;
+    sector_t capacity = member ? member_sectors : array_sectors;
+    unsigned long mask;
+    unsigned int m;
+
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq))
+    {
+    case REQ_OP_FLUSH:
+        blk_mq_end_request(rq, errno_to_blk_status(storage_flush()));
+        return BLK_STS_OK;
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        break;
+    default:
+        blk_mq_end_request(rq, BLK_STS_NOTSUPP);
+        return BLK_STS_OK;
+    }
+
+    if (!blk_rq_sectors(rq) || blk_rq_pos(rq) + blk_rq_sectors(rq) > capacity)
+    {
+        blk_mq_end_request(rq, BLK_STS_IOERR);
+        return BLK_STS_OK;
+    }
+
+    cmd->error = 0;
+    cmd->bvec = NULL;
+    /* No memory for the segment list: blk-mq retries the request later */
+    if (req_op(rq) == REQ_OP_WRITE && storage_rq_iter(rq, &cmd->iter, &cmd->bvec))
+        return BLK_STS_RESOURCE;
+    mask = member ? BIT(member - members) : array_members_of(rq);
+    atomic_set(&cmd->pending, hweight_long(mask));
+    for_each_set_bit(m, &mask, array_members)
+        queue_work(members[m].wq, &cmd->io[m].work);
+    return BLK_STS_OK;
+}
+
+static int array_init_request(struct blk_mq_tag_set *set, struct request *rq,
+                              unsigned int hctx_idx, unsigned int numa_node)
+{
+    struct array_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    unsigned int m;
+
+    for (m = 0; m < ARRAY_MAX_MEMBERS; m++)
+    {
+        INIT_WORK(&cmd->io[m].work, array_io_work);
+        cmd->io[m].rq = rq;
+        cmd->io[m].member = m;
+    }
+    return 0;
+}
+
+static const struct blk_mq_ops array_mq_ops = {
+    .queue_rq     = array_queue_rq,
+    .init_request = array_init_request,
+};
+
+static const struct block_device_operations array_fops = {
+    .owner = THIS_MODULE,
+};
+
+/* Minor 0 is the array, a member's queuedata points at the member */
+static struct gendisk *array_add_disk(struct array_member *member, int minor, sector_t capacity)
+{
+    struct gendisk *disk;
+    int ret;
+
+    disk = blk_mq_alloc_disk(&array_tag_set, member);
+    if (IS_ERR(disk))
+        return disk;
+
+    disk->major = array_major;
+    disk->first_minor = minor;
+    disk->minors = 1;
+    disk->fops = &array_fops;
+    if (member)
+        snprintf(disk->disk_name, DISK_NAME_LEN, "vmember%d", minor - 1);
+    else
+    {
+        snprintf(disk->disk_name, DISK_NAME_LEN, "varray%d", 0);
+        blk_queue_io_min(disk->queue, STORAGE_SECTOR_SIZE << chunk_shift);
+        if (array_level == 0)
+            blk_queue_io_opt(disk->queue, (STORAGE_SECTOR_SIZE << chunk_shift) * array_members);
+    }
+    blk_queue_logical_block_size(disk->queue, STORAGE_SECTOR_SIZE);
+    disk->queue->limits.discard_granularity = STORAGE_SECTOR_SIZE;
+    blk_queue_max_discard_sectors(disk->queue, UINT_MAX);
+    blk_queue_max_write_zeroes_sectors(disk->queue, UINT_MAX);
+    /* Flushes and FUA writes wait for the store's journal */
+    blk_queue_write_cache(disk->queue, true, true);
+    set_capacity(disk, capacity);
+
+    ret = add_disk(disk);
+    if (ret)
+    {
+        put_disk(disk);
+        return ERR_PTR(ret);
+    }
+    return disk;
+}
+
+/* Undo array_init() as far as it got */
+static void array_destroy(void)
+{
+    unsigned int m;
+
+    if (array_disk)
+    {
+        del_gendisk(array_disk);
+        put_disk(array_disk);
+    }
+    for (m = 0; m < array_members; m++)
+    {
+        if (members[m].disk)
+        {
+            del_gendisk(members[m].disk);
+            put_disk(members[m].disk);
+        }
+        if (members[m].wq)
+            destroy_workqueue(members[m].wq);
+    }
+    blk_mq_free_tag_set(&array_tag_set);
+    unregister_blkdev(array_major, "varray");
+}
+
+static int __init array_init(void)
+{
+    unsigned int chunk_sectors = array_chunk_kb * (1024 / STORAGE_SECTOR_SIZE);
+    unsigned int m;
+    int ret;
+
+    if (array_members < 2 || array_members > ARRAY_MAX_MEMBERS || array_level > 1 ||
+        !is_power_of_2(chunk_sectors))
+    {
+        pr_err("storageArray: need 2-%d members, level 0 or 1 and a power of two chunk\n",
+               ARRAY_MAX_MEMBERS);
+        return -EINVAL;
+    }
+    chunk_shift = ilog2(chunk_sectors);
+    member_sectors = round_down(div_u64(storage_nr_sectors(), array_members), chunk_sectors);
+    if (!member_sectors)
+    {
+        pr_err("storageArray: store too small for %u members of one %u KB chunk\n",
+               array_members, array_chunk_kb);
+        return -EINVAL;
+    }
+    array_sectors = array_level == 0 ? member_sectors * array_members : member_sectors;
+
+    array_major = register_blkdev(0, "varray");
+    if (array_major < 0)
+        return array_major;
+
+    memset(&array_tag_set, 0, sizeof(array_tag_set));
+    array_tag_set.ops = &array_mq_ops;
+    array_tag_set.nr_hw_queues = num_online_cpus();
+    array_tag_set.queue_depth = queue_depth;
+    array_tag_set.numa_node = NUMA_NO_NODE;
+    array_tag_set.cmd_size = sizeof(struct array_cmd);
+    array_tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+
+    ret = blk_mq_alloc_tag_set(&array_tag_set);
+    if (ret)
+    {
+        unregister_blkdev(array_major, "varray");
+        return ret;
+    }
+
+    for (m = 0; m < array_members; m++)
+    {
+        members[m].start = m * member_sectors;
+        members[m].wq = alloc_workqueue("storage_array%u", WQ_UNBOUND | WQ_MEM_RECLAIM, 1, m);
+        if (!members[m].wq)
+        {
+            ret = -ENOMEM;
+            goto err;
+        }
+        members[m].disk = array_add_disk(&members[m], m + 1, member_sectors);
+        if (IS_ERR(members[m].disk))
+        {
+            ret = PTR_ERR(members[m].disk);
+            members[m].disk = NULL;
+            goto err;
+        }
+    }
+
+    array_disk = array_add_disk(NULL, 0, array_sectors);
+    if (IS_ERR(array_disk))
+    {
+        ret = PTR_ERR(array_disk);
+        array_disk = NULL;
+        goto err;
+    }
+
+    pr_info("storageArray: %s ready, RAID-%u over %u members of %llu sectors, %u KB chunks\n",
+            array_disk->disk_name, array_level, array_members,
+            (unsigned long long)member_sectors, array_chunk_kb);
+    return 0;
+
+err:
+    array_destroy();
+    return ret;
+}
+
+static void __exit array_exit(void)
+{
+    array_destroy();
+    pr_info("storageArray: unloaded\n");
+}
+
+module_init(array_init);
+module_exit(array_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("SK AHMED");
+MODULE_DESCRIPTION("RAID-0/1 array of member disks over the storageDevice sector store");
@@ -0,0 +1,44 @@
+#ifndef _STORAGE_BLK_H
+#define _STORAGE_BLK_H
+
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+
+/*
+ * Shared by the blk-mq frontends: all segments of a write request as one
+ * bvec iov_iter, so storage_copy_in_iter() journals it as a single change.
+ * A request of one bio uses its bvecs in place, a merged one gets them
+ * gathered into *bvecp, which the caller kfree()s either way. Called from
+ * queue_rq, which returns BLK_STS_RESOURCE on -ENOMEM so that blk-mq
+ * retries the request instead of failing it.
+ */
+static inline int storage_rq_iter(struct request *rq, struct iov_iter *iter, struct bio_vec **bvecp)
+{
+    unsigned int nr = blk_rq_nr_bvec(rq);
+    struct req_iterator rq_iter;
+    struct bio_vec bv, *bvec;
+    unsigned int i = 0;
+
+    *bvecp = NULL;
+    if (rq->bio == rq->biotail)
+    {
+        struct bio *bio = rq->bio;
+
+        iov_iter_bvec(iter, WRITE, __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter), nr, blk_rq_bytes(rq));
+        iter->iov_offset = bio->bi_iter.bi_bvec_done;
+        return 0;
+    }
+
+    /* Runs in the I/O path, so no allocation may recurse into I/O */
+    bvec = kmalloc_array(nr, sizeof(*bvec), GFP_NOIO);
+    if (!bvec)
+        return -ENOMEM;
+    rq_for_each_bvec(bv, rq, rq_iter)
+        bvec[i++] = bv;
+    iov_iter_bvec(iter, WRITE, bvec, nr, blk_rq_bytes(rq));
+    *bvecp = bvec;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,207 @@
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/highmem.h>
+#include <linux/sched/mm.h>
+#include "storage_kernel.h"
+#include "storage_blk.h"
+
+/*
+ * blk-mq frontend: /dev/vblk0 is a real block device over the sector store
+ * of storage_kernel.c, so the page cache, I/O schedulers, O_DIRECT, fio and
+ * dd all work on it. Requests take the store's stripe locks and honour the
+ * same sector write locks as /dev/storageDevice. The block device has its
+ * own page cache, so don't mix buffered I/O on both nodes.
+ */
+
+static unsigned int nr_hw_queues;
+module_param(nr_hw_queues, uint, 0444);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default: one per online CPU)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Requests in flight per hardware queue");
+
+static int vblk_major;
+static struct blk_mq_tag_set vblk_tag_set;
+static struct gendisk *vblk_disk;
+
+/*
+ * Copy rq to the store at pos from the iterator over its segments, or out
+ * of it with none. A write goes in as one change, so the journal replays
+ * all of its segments or none.
+ */
+static blk_status_t vblk_transfer(struct request *rq, loff_t pos, struct iov_iter *from)
+{
+    struct req_iterator iter;
+    struct bio_vec bv;
+
+    if (from)
+        return errno_to_blk_status(storage_copy_in_iter(pos, from));
+
+    rq_for_each_segment(bv, rq, iter)
+    {
+        void *p = bvec_kmap_local(&bv);
+        int ret = storage_copy_out(pos, p, bv.bv_len);
+
+        kunmap_local(p);
+        if (ret)
+            return errno_to_blk_status(ret);
+        pos += bv.bv_len;
+    }
+    return BLK_STS_OK;
+}
+
+/*
+ * Requests are served synchronously in the submitting context. The stripe
+ * locks may sleep, hence BLK_MQ_F_BLOCKING; sector allocation must not
+ * recurse into I/O, hence the noio scope.
+ */
+static blk_status_t vblk_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+    struct request *rq = bd->rq;
+    sector_t first = blk_rq_pos(rq);
+    sector_t last = first + blk_rq_sectors(rq) - 1;
+    blk_status_t status = BLK_STS_OK;
+    struct bio_vec *bvec = NULL;
+    unsigned int noio_flags;
+    bool write, erase = false;
+    struct iov_iter from;
+
+    blk_mq_start_request(rq);
+
+    switch (req_op(rq))
+    {
+    case REQ_OP_FLUSH:
+        /* Only the store's journal, if it has one, sits below */
+        blk_mq_end_request(rq, errno_to_blk_status(storage_flush()));
+        return BLK_STS_OK;
+    case REQ_OP_READ:
+        write = false;
+        break;
+    case REQ_OP_WRITE:
+        write = true;
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        /* Both drop the sectors: the store reads unallocated sectors as zeros */
+        write = erase = true;
+        break;
+    default:
+        blk_mq_end_request(rq, BLK_STS_NOTSUPP);
+        return BLK_STS_OK;
+    }
+
+    if (!blk_rq_sectors(rq) || last >= storage_nr_sectors())
+    {
+        blk_mq_end_request(rq, BLK_STS_IOERR);
+        return BLK_STS_OK;
+    }
+
+    /* No memory for the segment list: blk-mq retries the request later */
+    if (write && !erase && storage_rq_iter(rq, &from, &bvec))
+        return BLK_STS_RESOURCE;
+
+    noio_flags = memalloc_noio_save();
+    storage_lock_range(first, last, write);
+    /* A write touching a locked sector fails as a whole, like storage_write() */
+    if (write && storage_range_locked(first, last))
+        status = BLK_STS_IOERR;
+    else if (erase)
+        status = errno_to_blk_status(storage_erase_range(first, last));
+    else
+        status = vblk_transfer(rq, (loff_t)first << STORAGE_SECTOR_SHIFT,
+                               write ? &from : NULL);
+    storage_unlock_range(first, last, write);
+    kfree(bvec);
+    if (status == BLK_STS_OK && (rq->cmd_flags & REQ_FUA))
+        status = errno_to_blk_status(storage_flush());
+    memalloc_noio_restore(noio_flags);
+
+    blk_mq_end_request(rq, status);
+    return BLK_STS_OK;
+}
+
+static const struct blk_mq_ops vblk_mq_ops = {
+    .queue_rq = vblk_queue_rq,
+};
+
+static const struct block_device_operations vblk_fops = {
+    .owner = THIS_MODULE,
+};
+
+static int __init vblk_init(void)
+{
+    int ret;
+
+    vblk_major = register_blkdev(0, "vblk");
+    if (vblk_major < 0)
+        return vblk_major;
+
+    memset(&vblk_tag_set, 0, sizeof(vblk_tag_set));
+    vblk_tag_set.ops = &vblk_mq_ops;
+    vblk_tag_set.nr_hw_queues = nr_hw_queues ? nr_hw_queues : num_online_cpus();
+    vblk_tag_set.queue_depth = queue_depth;
+    vblk_tag_set.numa_node = NUMA_NO_NODE;
+    vblk_tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+
+    ret = blk_mq_alloc_tag_set(&vblk_tag_set);
+    if (ret)
+    {
+        unregister_blkdev(vblk_major, "vblk");
+        return ret;
+    }
+
+    vblk_disk = blk_mq_alloc_disk(&vblk_tag_set, NULL);
+    if (IS_ERR(vblk_disk))
+    {
+        ret = PTR_ERR(vblk_disk);
+        blk_mq_free_tag_set(&vblk_tag_set);
+        unregister_blkdev(vblk_major, "vblk");
+        return ret;
+    }
+
+    vblk_disk->major = vblk_major;
+    vblk_disk->first_minor = 0;
+    vblk_disk->minors = 1;
+    vblk_disk->fops = &vblk_fops;
+    snprintf(vblk_disk->disk_name, DISK_NAME_LEN, "vblk%d", 0);
+    blk_queue_logical_block_size(vblk_disk->queue, STORAGE_SECTOR_SIZE);
+    vblk_disk->queue->limits.discard_granularity = STORAGE_SECTOR_SIZE;
+    blk_queue_max_discard_sectors(vblk_disk->queue, UINT_MAX);
+    blk_queue_max_write_zeroes_sectors(vblk_disk->queue, UINT_MAX);
+    /* Flushes and FUA writes wait for the store's journal */
+    blk_queue_write_cache(vblk_disk->queue, true, true);
+    set_capacity(vblk_disk, storage_nr_sectors());
+
+    ret = add_disk(vblk_disk);
+    if (ret)
+    {
+        put_disk(vblk_disk);
+        blk_mq_free_tag_set(&vblk_tag_set);
+        unregister_blkdev(vblk_major, "vblk");
+        return ret;
+    }
+
+    pr_info("vblk: %s ready (%llu sectors, %u hw queues x %u deep)\n",
+            vblk_disk->disk_name, (unsigned long long)storage_nr_sectors(),
+            vblk_tag_set.nr_hw_queues, vblk_tag_set.queue_depth);
+    return 0;
+}
+
+static void __exit vblk_exit(void)
+{
+    del_gendisk(vblk_disk);
+    put_disk(vblk_disk);
+    blk_mq_free_tag_set(&vblk_tag_set);
+    unregister_blkdev(vblk_major, "vblk");
+    pr_info("vblk: unloaded\n");
+}
+
+module_init(vblk_init);
+module_exit(vblk_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("SK AHMED");
+MODULE_DESCRIPTION("blk-mq block device over the storageDevice sector store");
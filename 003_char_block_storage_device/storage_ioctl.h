@@ -0,0 +1,148 @@
+#ifndef _STORAGE_IOCTL_H
+#define _STORAGE_IOCTL_H
+
+/* ioctl interface of /dev/storageDevice, shared by the driver and user space */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define STORAGE_LOCK_INFO_SECTORS 8	/* sectors reported by IOCTL_GET_LOCK_INFO */
+#define STORAGE_SNAP_NAME_LEN     32	/* snapshot names, NUL included */
+#define STORAGE_KEY_LEN           16	/* unlock keys, NUL included */
+#define STORAGE_UNLOCK_MAX_RANGES 1024	/* ranges per IOCTL_UNLOCK_RANGES */
+
+/* Sector range [first, first + count) */
+struct storage_range
+{
+    __u64 first;
+    __u64 count;
+};
+
+/*
+ * Unlocking takes one of the user_keys, compared whole. A sector may have
+ * an ACL limiting it to some of them, see IOCTL_SET_SECTOR_KEYS.
+ */
+
+/* IOCTL_UNLOCK_SECTOR */
+struct storage_unlock
+{
+    __u64 sector;
+    char key[STORAGE_KEY_LEN];
+};
+
+/* IOCTL_UNLOCK_RANGE */
+struct storage_range_unlock
+{
+    struct storage_range range;
+    char key[STORAGE_KEY_LEN];
+};
+
+/*
+ * IOCTL_UNLOCK_RANGES: unlock nr ranges with one key, all of them or,
+ * if any range is invalid or refuses the key, none.
+ */
+struct storage_unlock_ranges
+{
+    __u64 ranges;	/* user pointer to nr struct storage_range */
+    __u32 nr;
+    __u32 reserved;
+    char key[STORAGE_KEY_LEN];
+};
+
+/*
+ * IOCTL_SET_SECTOR_KEYS (CAP_SYS_ADMIN): only the user_keys whose index
+ * bit is set in keys may unlock the range from now on; 0 lets any key
+ * unlock it again, as sectors start out.
+ */
+struct storage_key_acl
+{
+    struct storage_range range;
+    __u64 keys;
+};
+
+/*
+ * IOCTL_GET_LOCK_BITMAP: lock state of range as packed bits, sector
+ * range.first + i is locked when bit (i % 8) of byte i / 8 is set.
+ */
+struct storage_lock_bitmap
+{
+    struct storage_range range;
+    __u64 bits;		/* user pointer to (range.count + 7) / 8 bytes */
+};
+
+/*
+ * IOCTL_BACKUP_DELTA file: this header, then nr_extents extents, each a
+ * struct storage_delta_extent followed by count sectors of data. Applying
+ * the extents in order to the previous image gives the current one.
+ */
+#define STORAGE_DELTA_MAGIC "VBLKDLT1"
+
+struct storage_delta_header
+{
+    char magic[8];
+    __u32 sector_size;
+    __u32 reserved;
+    __u64 nr_sectors;	/* device capacity */
+    __u64 nr_extents;
+    __u64 nr_changed;	/* sectors carried in the file */
+};
+
+struct storage_delta_extent
+{
+    __u64 first;
+    __u64 count;
+};
+
+/*
+ * Journal files (the journal parameter): records, each this header and
+ * count sectors of data, none for a checkpoint marker or an erase. A file
+ * opens with a checkpoint, the image records of every allocated run of
+ * sectors followed by the marker, all with the checkpoint's seq; the
+ * changes after it follow with increasing seqs. A change of more sectors
+ * than fit one record is split, every record but its last flagged
+ * continued; replay drops a change whose last record is missing. crc is
+ * the CRC32C of the data followed by the header with crc zero.
+ */
+#define STORAGE_JOURNAL_MAGIC      0x4c4e524a	/* "JRNL" */
+#define STORAGE_JOURNAL_IMAGE      0x1	/* checkpoint image */
+#define STORAGE_JOURNAL_CHECKPOINT 0x2	/* end of the image */
+#define STORAGE_JOURNAL_ERASE      0x4	/* count sectors erased */
+#define STORAGE_JOURNAL_CONTINUED  0x8	/* the change goes on in the next record */
+
+struct storage_journal_record
+{
+    __u32 magic;
+    __u32 crc;
+    __u64 seq;
+    __u64 first;
+    __u32 count;
+    __u32 flags;
+};
+
+/* IOCTL commands */
+#define IOCTL_LOCK_SECTOR    	_IOW('L', 0x1, int)
+#define IOCTL_UNLOCK_SECTOR  	_IOW('U', 0x2, struct storage_unlock)
+#define IOCTL_GET_LOCK_INFO  	_IOR('I', 0x3, __u8[STORAGE_LOCK_INFO_SECTORS])
+#define IOCTL_ERASE_SECTOR   	_IOW('E', 0x4, int)
+#define IOCTL_MIRROR_SECTOR  	_IOW('M', 0x5, int)
+#define IOCTL_BACKUP_TO_FILE 	_IOW('B', 0x6, char *)
+#define IOCTL_LOCK_RANGE     	_IOW('L', 0x7, struct storage_range)
+#define IOCTL_UNLOCK_RANGE   	_IOW('U', 0x8, struct storage_range_unlock)
+#define IOCTL_GET_LOCK_BITMAP	_IOW('I', 0x9, struct storage_lock_bitmap)
+#define IOCTL_MIRROR_SYNC    	_IO('M', 0xA)	/* copy every dirty sector to the mirror now */
+#define IOCTL_BACKUP_DELTA   	_IOW('B', 0xB, char *)	/* sectors changed since the last backup */
+#define IOCTL_ERASE_RANGE    	_IOW('E', 0xF, struct storage_range)	/* zero and deallocate */
+#define IOCTL_MMAP_SYNC      	_IOW('M', 0x10, struct storage_range)	/* msync() for mmap()ed sectors */
+#define IOCTL_UNLOCK_RANGES  	_IOW('U', 0x11, struct storage_unlock_ranges)
+#define IOCTL_SET_SECTOR_KEYS	_IOW('K', 0x12, struct storage_key_acl)
+
+/*
+ * Copy-on-write snapshots, named by a STORAGE_SNAP_NAME_LEN string. CREATE
+ * and DELETE go to /dev/storageDevice. /dev/storageSnap reads the newest
+ * snapshot as of open(); SELECT on that file switches to another one.
+ */
+#define IOCTL_SNAP_CREATE    	_IOW('S', 0xC, char[STORAGE_SNAP_NAME_LEN])
+#define IOCTL_SNAP_DELETE    	_IOW('S', 0xD, char[STORAGE_SNAP_NAME_LEN])
+#define IOCTL_SNAP_SELECT    	_IOW('S', 0xE, char[STORAGE_SNAP_NAME_LEN])
+
+#endif
@@ -5,110 +5,3148 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+#include <linux/bitmap.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/crc32c.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/crypto.h>
+#include <linux/percpu.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/fadvise.h>
+#include <linux/hashtable.h>
+#include <linux/capability.h>
+#include "storage_ioctl.h"
+#include "storage_kernel.h"
 
 /* Module parameter array: valid character keys for unlocking */
 static char *user_keys[8];
 static int key_count;
-module_param_array(user_keys, charp, &key_count, 0644);
-MODULE_PARM_DESC(user_keys, "List of keys for unlocking write permission");
+module_param_array(user_keys, charp, &key_count, 0444);
+MODULE_PARM_DESC(user_keys, "List of keys for unlocking write permission (up to 15 characters each)");
 
-#define STORAGE_TOTAL_SIZE   4096
-#define STORAGE_SECTOR_SIZE  512
-#define STORAGE_NUM_SECTORS  (STORAGE_TOTAL_SIZE / STORAGE_SECTOR_SIZE)
+/* Capacity, e.g. "4K", "512M" or "8G"; rounded down to whole sectors */
+static char *storage_size = "4K";
+module_param(storage_size, charp, 0444);
+MODULE_PARM_DESC(storage_size, "Backing store capacity (K/M/G suffixes), sectors are allocated on first write");
 
-/* IOCTL commands */
-#define IOCTL_LOCK_SECTOR    	_IOW('L', 0x1, int)
-#define IOCTL_UNLOCK_SECTOR  	_IOW('U', 0x2, int)
-#define IOCTL_GET_LOCK_INFO  	_IOR('I', 0x3, bool[STORAGE_NUM_SECTORS])
-#define IOCTL_ERASE_SECTOR   	_IOW('E', 0x4, int)
-#define IOCTL_MIRROR_SECTOR  	_IOW('M', 0x5, int)
-#define IOCTL_BACKUP_TO_FILE 	_IOW('B', 0x6, char *)
+#define STORAGE_MAX_SIZE     (64ULL << 30)
+
+static unsigned int mirror_interval_ms = 100;
+module_param(mirror_interval_ms, uint, 0644);
+MODULE_PARM_DESC(mirror_interval_ms, "Delay before written sectors are copied to the mirror (ms, writable at runtime)");
+
+static unsigned int scrub_rate = 2048;
+module_param(scrub_rate, uint, 0644);
+MODULE_PARM_DESC(scrub_rate, "Sectors per second checked against the mirror by the scrubber (0 pauses it)");
+
+static char *compress = "";
+module_param(compress, charp, 0444);
+MODULE_PARM_DESC(compress, "Keep sectors compressed with this crypto API algorithm, e.g. lz4 or zstd (default: off)");
+
+static bool dedup;
+module_param(dedup, bool, 0444);
+MODULE_PARM_DESC(dedup, "Store identical sectors once, shared copy-on-write (not with compress)");
+
+static char *image = "";
+module_param(image, charp, 0444);
+MODULE_PARM_DESC(image, "Raw image loaded into the store at load, e.g. one written by IOCTL_BACKUP_TO_FILE (default: none)");
+
+static char *journal = "";
+module_param(journal, charp, 0444);
+MODULE_PARM_DESC(journal, "Write-ahead journal, kept in <journal>.0 and <journal>.1 and replayed at load (default: off)");
+
+static unsigned int journal_interval_ms = 20;
+module_param(journal_interval_ms, uint, 0644);
+MODULE_PARM_DESC(journal_interval_ms, "Group commit interval of the journal (ms, writable at runtime)");
+
+static unsigned int journal_max_mb = 64;
+module_param(journal_max_mb, uint, 0644);
+MODULE_PARM_DESC(journal_max_mb, "Journal size that triggers a checkpoint into the other journal file (MB)");
 
 /* In storage_mirror_kernel.c*/
 extern void mirror_sector(int sector, const unsigned char *data);
+extern int mirror_set_capacity(sector_t nr_sectors);
+extern int mirror_write_batch(const sector_t *sectors, const unsigned char *data, unsigned int n);
+extern int mirror_fetch_sector(sector_t sector, unsigned char *data);
 extern int vblock_backup_to_file(const char *path);
+extern int vblock_backup_delta(const char *path);
+
+/* Device globals */
+static struct class *storage_class;
+static struct device *storage_device;
+static dev_t storage_dev_number;
+static struct cdev storage_cdev;
+static struct device *snap_device;
+static struct cdev snap_cdev;
+
+/*
+ * Sparse backing store: the xarray maps a sector number to its
+ * STORAGE_SECTOR_SIZE buffer, which is allocated on the first write. Sectors
+ * that were never written have no entry, cost no memory and read as zeros.
+ * Every allocated sector has a CRC32C of its contents in csums (see
+ * csum_set()), updated by each write and checked by each read. With the compress
+ * or dedup parameter set, the entries are compressed blobs or shared
+ * dedup_blocks instead (see below).
+ */
+struct sector_store
+{
+    struct xarray sectors;
+    struct xarray csums;
+    sector_t nr_sectors;
+    loff_t size;		/* nr_sectors << STORAGE_SECTOR_SHIFT */
+    atomic_long_t nr_allocated;
+};
+
+static struct sector_store store;
+static struct kmem_cache *sector_cache;
+static const unsigned char zero_sector[STORAGE_SECTOR_SIZE];
+static u32 zero_crc;
+
+enum store_mode { STORE_PLAIN, STORE_COMPRESSED, STORE_DEDUP };
+static enum store_mode store_mode;
+static unsigned char *stripe_scratch;	/* a sector per stripe, outside STORE_PLAIN */
+
+/*
+ * csums entries: the CRC32C of a sector and its compressed length. A
+ * 64-bit value entry holds both, the CRC in its low 32 bits. A 32-bit one
+ * has room for only 31 bits, so there the entry points at a sector_csum.
+ * csum_slot() creates the entry of a newly allocated sector; csum_set()
+ * then never allocates. Both run with the sector's stripe held for write.
+ */
+#if BITS_PER_LONG == 64
+static int csum_slot(sector_t sector)
+{
+    return xa_err(xa_store(&store.csums, sector, xa_mk_value(0), GFP_KERNEL));
+}
+
+static void csum_set(sector_t sector, u32 crc, unsigned int clen)
+{
+    xa_store(&store.csums, sector, xa_mk_value((unsigned long)clen << 32 | crc), GFP_KERNEL);
+}
+
+static u32 csum_crc(const void *entry)
+{
+    return (u32)xa_to_value(entry);
+}
+
+static unsigned int csum_clen(const void *entry)
+{
+    return entry ? xa_to_value(entry) >> 32 : 0;
+}
+
+static void csum_free(void *entry)
+{
+}
+#else
+struct sector_csum
+{
+    u32 crc;
+    u32 clen;
+};
+
+static int csum_slot(sector_t sector)
+{
+    struct sector_csum *c = kzalloc(sizeof(*c), GFP_KERNEL);
+
+    if (!c)
+        return -ENOMEM;
+    if (xa_is_err(xa_store(&store.csums, sector, c, GFP_KERNEL)))
+    {
+        kfree(c);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Readers hold the stripe for read, so they never see half an update */
+static void csum_set(sector_t sector, u32 crc, unsigned int clen)
+{
+    struct sector_csum *c = xa_load(&store.csums, sector);
+
+    c->crc = crc;
+    c->clen = clen;
+}
+
+static u32 csum_crc(const void *entry)
+{
+    return ((const struct sector_csum *)entry)->crc;
+}
+
+static unsigned int csum_clen(const void *entry)
+{
+    return entry ? ((const struct sector_csum *)entry)->clen : 0;
+}
+
+static void csum_free(void *entry)
+{
+    kfree(entry);
+}
+#endif
+
+/*
+ * One bit per sector, set while the sector is write-locked. The write path
+ * checks a whole request with a single find_next_bit(). Bits only change
+ * with the sectors' stripes held for write, and under lock_bits_lock since
+ * neighbouring stripes share bitmap words.
+ */
+static unsigned long *sector_lock_bits;
+static DEFINE_SPINLOCK(lock_bits_lock);
+
+/*
+ * Unlock ACLs, see storage_key_find(): disjoint ranges sorted by first
+ * sector, each with the mask of keys allowed to unlock it. acl_mutex is
+ * held from the check of an unlock to its end, so the keys of a range
+ * can't change in between.
+ */
+struct storage_acl
+{
+    struct list_head list;
+    sector_t first;
+    sector_t last;
+    u64 keys;
+};
+
+static LIST_HEAD(sector_acls);
+static DEFINE_MUTEX(acl_mutex);
+
+/*
+ * Striped sector locks instead of one device-wide mutex. Each stripe is a
+ * reader/writer semaphore covering every STORAGE_STRIPE_SECTORS run of
+ * sectors that hashes to it, so a page-sized request takes a single lock
+ * and requests on unrelated sectors mostly proceed in parallel. Semaphores
+ * rather than spinning locks because the holder copies to/from user space.
+ * A run is a page worth of sectors, which mmap() relies on.
+ */
+#define STORAGE_LOCK_STRIPES  64	/* power of two */
+#define STORAGE_STRIPE_SECTORS (PAGE_SIZE >> STORAGE_SECTOR_SHIFT)
+
+static struct rw_semaphore stripe_locks[STORAGE_LOCK_STRIPES];
+
+static unsigned int stripe_of(sector_t sector)
+{
+    return (sector / STORAGE_STRIPE_SECTORS) & (STORAGE_LOCK_STRIPES - 1);
+}
+
+/* Is stripe i used by the sectors first..last? */
+static bool stripe_in_range(unsigned int i, sector_t first, sector_t last)
+{
+    sector_t runs = last / STORAGE_STRIPE_SECTORS - first / STORAGE_STRIPE_SECTORS + 1;
+    unsigned int start = stripe_of(first);
+
+    if (runs >= STORAGE_LOCK_STRIPES)
+        return true;
+    return ((i - start) & (STORAGE_LOCK_STRIPES - 1)) < runs;
+}
+
+/*
+ * Lock every stripe covering sectors first..last. Stripes are always taken
+ * in ascending index order, so overlapping requests can't deadlock.
+ */
+void storage_lock_range(sector_t first, sector_t last, bool write)
+{
+    unsigned int i;
+
+    for (i = 0; i < STORAGE_LOCK_STRIPES; i++)
+    {
+        if (!stripe_in_range(i, first, last))
+            continue;
+        if (write)
+            down_write(&stripe_locks[i]);
+        else
+            down_read(&stripe_locks[i]);
+    }
+}
+EXPORT_SYMBOL(storage_lock_range);
+
+void storage_unlock_range(sector_t first, sector_t last, bool write)
+{
+    unsigned int i;
+
+    for (i = 0; i < STORAGE_LOCK_STRIPES; i++)
+    {
+        if (!stripe_in_range(i, first, last))
+            continue;
+        if (write)
+            up_write(&stripe_locks[i]);
+        else
+            up_read(&stripe_locks[i]);
+    }
+}
+EXPORT_SYMBOL(storage_unlock_range);
+
+/* Sector buffer, or NULL if the sector was never written */
+static unsigned char *store_lookup(sector_t sector)
+{
+    return xa_load(&store.sectors, sector);
+}
+
+/* Sector buffer for writing, allocated zeroed on first use */
+static unsigned char *store_get(sector_t sector)
+{
+    unsigned char *buf = xa_load(&store.sectors, sector);
+    unsigned char *old;
+
+    if (buf)
+        return buf;
+
+    buf = kmem_cache_zalloc(sector_cache, GFP_KERNEL);
+    if (!buf)
+        return NULL;
+    old = xa_cmpxchg(&store.sectors, sector, NULL, buf, GFP_KERNEL);
+    if (old)
+    {
+        /* Lost a race for the slot, or the xarray node allocation failed */
+        kmem_cache_free(sector_cache, buf);
+        return xa_is_err(old) ? NULL : old;
+    }
+    /* The checksum slot is created here, so later updates never allocate */
+    if (csum_slot(sector))
+    {
+        xa_erase(&store.sectors, sector);
+        kmem_cache_free(sector_cache, buf);
+        return NULL;
+    }
+    csum_set(sector, zero_crc, 0);
+    atomic_long_inc(&store.nr_allocated);
+    return buf;
+}
+
+/*
+ * Compressed mode. Each sector is compressed on write with the crypto API
+ * algorithm named by the compress parameter and kept in a kmalloc() blob
+ * of just that size. The compressed length lives next to the checksum in
+ * the sector's csums entry; 0 means the sector didn't compress and is kept
+ * as is in a sector_cache buffer. Writers assemble a sector in their
+ * stripe's scratch buffer and store_put() it; readers decompress into a
+ * buffer of their own. The tfms keep state, so
+ * there is one per CPU, each under a mutex since compression can sleep.
+ */
+#define COMP_MAX_LEN (STORAGE_SECTOR_SIZE / 2)	/* larger blobs land in kmalloc-512 anyway */
+
+struct comp_stream
+{
+    struct mutex lock;
+    struct crypto_comp *tfm;
+    unsigned char buf[2 * STORAGE_SECTOR_SIZE];
+};
+
+static struct comp_stream __percpu *comp_streams;
+static atomic_long_t comp_bytes;	/* memory held by sector data */
+
+/* Blob holding src compressed, or a copy of it if it doesn't compress (*clen = 0) */
+static void *comp_compress(const unsigned char *src, unsigned int *clen)
+{
+    struct comp_stream *cs = raw_cpu_ptr(comp_streams);
+    unsigned int dlen = sizeof(cs->buf);
+    void *blob;
+
+    mutex_lock(&cs->lock);
+    if (!crypto_comp_compress(cs->tfm, src, STORAGE_SECTOR_SIZE, cs->buf, &dlen) &&
+        dlen <= COMP_MAX_LEN)
+    {
+        blob = kmalloc(dlen, GFP_KERNEL);
+        if (blob)
+            memcpy(blob, cs->buf, dlen);
+        *clen = dlen;
+    }
+    else
+    {
+        blob = kmem_cache_alloc(sector_cache, GFP_KERNEL);
+        if (blob)
+            memcpy(blob, src, STORAGE_SECTOR_SIZE);
+        *clen = 0;
+    }
+    mutex_unlock(&cs->lock);
+    return blob;
+}
+
+/* A blob that won't decompress comes out as zeros and fails its checksum */
+static void comp_decompress(const void *blob, unsigned int clen, unsigned char *dst)
+{
+    struct comp_stream *cs = raw_cpu_ptr(comp_streams);
+    unsigned int dlen = STORAGE_SECTOR_SIZE;
+    int ret;
+
+    mutex_lock(&cs->lock);
+    ret = crypto_comp_decompress(cs->tfm, blob, clen, dst, &dlen);
+    mutex_unlock(&cs->lock);
+    if (ret || dlen != STORAGE_SECTOR_SIZE)
+        memset(dst, 0, STORAGE_SECTOR_SIZE);
+}
+
+static size_t comp_blob_size(unsigned int clen)
+{
+    return clen ? clen : STORAGE_SECTOR_SIZE;
+}
+
+static void comp_blob_free(void *blob, unsigned int clen)
+{
+    if (clen)
+        kfree(blob);
+    else
+        kmem_cache_free(sector_cache, blob);
+}
+
+static void comp_exit(void)
+{
+    int cpu;
+
+    if (!comp_streams)
+        return;
+    for_each_possible_cpu(cpu)
+    {
+        struct comp_stream *cs = per_cpu_ptr(comp_streams, cpu);
+
+        if (!IS_ERR_OR_NULL(cs->tfm))
+            crypto_free_comp(cs->tfm);
+    }
+    free_percpu(comp_streams);
+    comp_streams = NULL;
+}
+
+static int comp_init(void)
+{
+    int cpu;
+
+    if (!*compress)
+        return 0;
+    if (!crypto_has_comp(compress, 0, 0))
+    {
+        pr_err("storageDevice: compression algorithm %s not available\n", compress);
+        return -ENOENT;
+    }
+
+    comp_streams = alloc_percpu(struct comp_stream);
+    if (!comp_streams)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+    {
+        struct comp_stream *cs = per_cpu_ptr(comp_streams, cpu);
+
+        mutex_init(&cs->lock);
+        cs->tfm = crypto_alloc_comp(compress, 0, 0);
+        if (IS_ERR(cs->tfm))
+        {
+            int ret = PTR_ERR(cs->tfm);
+
+            comp_exit();
+            return ret;
+        }
+    }
+    store_mode = STORE_COMPRESSED;
+    pr_info("storageDevice: sectors compressed with %s\n", compress);
+    return 0;
+}
+
+/*
+ * Deduplicated mode. Sector contents live in dedup_blocks shared by every
+ * sector holding the same bytes, found through a hash table keyed by the
+ * CRC32C the checksum code computes anyway and confirmed with memcmp().
+ * Blocks are never written in place: a writer assembles the new contents
+ * in its stripe's scratch buffer and store_put() moves the sector over to
+ * the matching block, dropping its reference on the old one, so writing
+ * to a shared sector is copy-on-write by construction. Buckets are
+ * guarded by DEDUP_LOCKS spinlocks.
+ */
+#define DEDUP_LOCKS 256
+#define DEDUP_MIN_BITS 8
+#define DEDUP_MAX_BITS 20
+
+struct dedup_block
+{
+    struct hlist_node node;
+    u32 crc;
+    unsigned int refs;		/* under the bucket's lock */
+    unsigned char data[STORAGE_SECTOR_SIZE];
+};
+
+static struct hlist_head *dedup_table;
+static unsigned int dedup_bits;
+static spinlock_t dedup_locks[DEDUP_LOCKS];
+static struct kmem_cache *dedup_cache;
+static atomic_long_t dedup_unique;
+
+static spinlock_t *dedup_lock(unsigned int bucket)
+{
+    return &dedup_locks[bucket & (DEDUP_LOCKS - 1)];
+}
+
+/* A reference to the block holding buf, created if there is none yet */
+static struct dedup_block *dedup_get(const unsigned char *buf, u32 crc)
+{
+    unsigned int bucket = hash_32(crc, dedup_bits);
+    struct dedup_block *blk, *new = NULL;
+
+    for (;;)
+    {
+        spin_lock(dedup_lock(bucket));
+        hlist_for_each_entry(blk, &dedup_table[bucket], node)
+        {
+            if (blk->crc == crc && !memcmp(blk->data, buf, STORAGE_SECTOR_SIZE))
+            {
+                blk->refs++;
+                spin_unlock(dedup_lock(bucket));
+                if (new)
+                    kmem_cache_free(dedup_cache, new);
+                return blk;
+            }
+        }
+        if (new)
+        {
+            hlist_add_head(&new->node, &dedup_table[bucket]);
+            spin_unlock(dedup_lock(bucket));
+            atomic_long_inc(&dedup_unique);
+            return new;
+        }
+        spin_unlock(dedup_lock(bucket));
+
+        /* Allocate outside the lock, then look again */
+        new = kmem_cache_alloc(dedup_cache, GFP_KERNEL);
+        if (!new)
+            return NULL;
+        new->crc = crc;
+        new->refs = 1;
+        memcpy(new->data, buf, STORAGE_SECTOR_SIZE);
+    }
+}
+
+static void dedup_put(struct dedup_block *blk)
+{
+    unsigned int bucket = hash_32(blk->crc, dedup_bits);
+    bool last;
+
+    spin_lock(dedup_lock(bucket));
+    last = !--blk->refs;
+    if (last)
+        hlist_del(&blk->node);
+    spin_unlock(dedup_lock(bucket));
+
+    if (last)
+    {
+        kmem_cache_free(dedup_cache, blk);
+        atomic_long_dec(&dedup_unique);
+    }
+}
+
+static void dedup_exit(void)
+{
+    kvfree(dedup_table);
+    dedup_table = NULL;
+    kmem_cache_destroy(dedup_cache);
+    dedup_cache = NULL;
+}
+
+static int dedup_init(void)
+{
+    int i;
+
+    if (!dedup)
+        return 0;
+    if (store_mode != STORE_PLAIN)
+    {
+        pr_err("storageDevice: dedup and compress can't be combined\n");
+        return -EINVAL;
+    }
+
+    /* About a bucket per four sectors of capacity */
+    dedup_bits = clamp_t(int, ilog2(store.nr_sectors) - 2, DEDUP_MIN_BITS, DEDUP_MAX_BITS);
+    dedup_table = kvcalloc(1U << dedup_bits, sizeof(*dedup_table), GFP_KERNEL);
+    dedup_cache = kmem_cache_create("storage_dedup", sizeof(struct dedup_block), 0, 0, NULL);
+    if (!dedup_table || !dedup_cache)
+    {
+        dedup_exit();
+        return -ENOMEM;
+    }
+    for (i = 0; i < DEDUP_LOCKS; i++)
+        spin_lock_init(&dedup_locks[i]);
+    store_mode = STORE_DEDUP;
+    pr_info("storageDevice: sector deduplication on (%u hash buckets)\n", 1U << dedup_bits);
+    return 0;
+}
+
+/*
+ * Checksums. crc32c() uses the CPU's CRC32C instruction where there is
+ * one. A sector failing its checksum makes the read fail with -EIO and is
+ * flagged in scrub_suspect_bits, so the scrubber repairs it from the
+ * mirror ahead of its regular walk.
+ */
+static unsigned long *scrub_suspect_bits;
+static struct task_struct *scrub_task;
+static atomic_long_t csum_errors;
+
+static u32 sector_crc(const void *buf)
+{
+    return crc32c(~0, buf, STORAGE_SECTOR_SIZE);
+}
+
+/* After modifying an allocated sector; its stripe is held for write */
+static void store_csum_update(sector_t sector, const unsigned char *buf)
+{
+    csum_set(sector, sector_crc(buf), 0);
+}
+
+static bool store_csum_ok(sector_t sector, const unsigned char *buf)
+{
+    void *entry = xa_load(&store.csums, sector);
+
+    return !entry || csum_crc(entry) == sector_crc(buf);
+}
+
+/*
+ * Sector contents without checking them: the store's own buffer, scratch
+ * holding the decompressed sector, or NULL for zeros. scratch is only
+ * used in compressed mode.
+ */
+static const unsigned char *store_fetch(sector_t sector, unsigned char *scratch)
+{
+    unsigned char *buf = store_lookup(sector);
+    unsigned int clen;
+
+    if (!buf)
+        return NULL;
+    switch (store_mode)
+    {
+    case STORE_DEDUP:
+        return ((struct dedup_block *)buf)->data;
+    case STORE_COMPRESSED:
+        clen = csum_clen(xa_load(&store.csums, sector));
+        if (!clen)
+            return buf;
+        comp_decompress(buf, clen, scratch);
+        return scratch;
+    default:
+        return buf;
+    }
+}
+
+/* store_fetch() for reading: -EIO if the sector fails its checksum */
+static int store_read_sector(sector_t sector, unsigned char *scratch, const unsigned char **bufp)
+{
+    const unsigned char *buf = store_fetch(sector, scratch);
+
+    if (buf && !store_csum_ok(sector, buf))
+    {
+        atomic_long_inc(&csum_errors);
+        pr_warn_ratelimited("storageDevice: sector %llu failed its checksum\n",
+                            (unsigned long long)sector);
+        set_bit(sector, scrub_suspect_bits);
+        if (scrub_task)
+            wake_up_process(scrub_task);
+        return -EIO;
+    }
+    *bufp = buf;
+    return 0;
+}
+
+/* Release a sector's data given its compressed length */
+static void store_entry_free(void *buf, unsigned int clen)
+{
+    switch (store_mode)
+    {
+    case STORE_DEDUP:
+        dedup_put(buf);
+        break;
+    case STORE_COMPRESSED:
+        atomic_long_sub(comp_blob_size(clen), &comp_bytes);
+        comp_blob_free(buf, clen);
+        break;
+    default:
+        kmem_cache_free(sector_cache, buf);
+    }
+}
+
+/* Forget a sector, it reads as zeros again; its stripe is held for write */
+static void store_drop(sector_t sector)
+{
+    void *buf = xa_erase(&store.sectors, sector);
+    void *entry = xa_erase(&store.csums, sector);
+
+    if (!buf)
+        return;
+    store_entry_free(buf, csum_clen(entry));
+    csum_free(entry);
+    atomic_long_dec(&store.nr_allocated);
+}
+
+/*
+ * Compressed and deduplicated modes: point sector at a new entry holding
+ * buf, a compressed blob or a shared dedup_block. A sector written all
+ * zeros is dropped back to the unwritten state, so zeros cost nothing.
+ */
+static int store_replace(sector_t sector, const unsigned char *buf)
+{
+    void *old = store_lookup(sector);
+    void *entry = xa_load(&store.csums, sector);
+    unsigned int clen = 0;
+    u32 crc;
+    void *blob;
+
+    if (!memchr_inv(buf, 0, STORAGE_SECTOR_SIZE))
+    {
+        store_drop(sector);
+        return 0;
+    }
+
+    crc = sector_crc(buf);
+    if (store_mode == STORE_DEDUP)
+        blob = dedup_get(buf, crc);
+    else
+    {
+        blob = comp_compress(buf, &clen);
+        if (blob)
+            atomic_long_add(comp_blob_size(clen), &comp_bytes);
+    }
+    if (!blob)
+        return -ENOMEM;
+
+    if (!old)
+    {
+        /* New slots in both xarrays; replacing entries never allocates */
+        if (csum_slot(sector) ||
+            xa_is_err(xa_store(&store.sectors, sector, blob, GFP_KERNEL)))
+        {
+            csum_free(xa_erase(&store.csums, sector));
+            store_entry_free(blob, clen);
+            return -ENOMEM;
+        }
+        atomic_long_inc(&store.nr_allocated);
+    }
+    else
+    {
+        xa_store(&store.sectors, sector, blob, GFP_KERNEL);
+        store_entry_free(old, csum_clen(entry));
+    }
+    csum_set(sector, crc, clen);
+    return 0;
+}
+
+/*
+ * Finish modifying the buffer store_get_cow() returned: update the
+ * checksum, or store the scratch buffer compressed or deduplicated.
+ */
+static int store_put(sector_t sector, const unsigned char *buf)
+{
+    if (store_mode != STORE_PLAIN)
+        return store_replace(sector, buf);
+    store_csum_update(sector, buf);
+    return 0;
+}
+
+/* Replace a whole sector, bypassing snapshots; its stripe is held for write */
+static int store_write_sector(sector_t sector, const unsigned char *src)
+{
+    unsigned char *buf;
+
+    if (store_mode != STORE_PLAIN)
+        return store_replace(sector, src);
+    buf = store_get(sector);
+    if (!buf)
+        return -ENOMEM;
+    memcpy(buf, src, STORAGE_SECTOR_SIZE);
+    store_csum_update(sector, buf);
+    return 0;
+}
+
+static int store_init(void)
+{
+    unsigned long long size = memparse(storage_size, NULL);
+    int i, ret;
+
+    if (size < STORAGE_SECTOR_SIZE || size > STORAGE_MAX_SIZE)
+    {
+        pr_err("storageDevice: storage_size %s out of range\n", storage_size);
+        return -EINVAL;
+    }
+    store.nr_sectors = size >> STORAGE_SECTOR_SHIFT;
+    store.size = (loff_t)store.nr_sectors << STORAGE_SECTOR_SHIFT;
+    atomic_long_set(&store.nr_allocated, 0);
+    xa_init(&store.sectors);
+    xa_init(&store.csums);
+    zero_crc = sector_crc(zero_sector);
+    for (i = 0; i < STORAGE_LOCK_STRIPES; i++)
+        init_rwsem(&stripe_locks[i]);
+
+    sector_cache = kmem_cache_create("storage_sector", STORAGE_SECTOR_SIZE,
+                                     STORAGE_SECTOR_SIZE, 0, NULL);
+    if (!sector_cache)
+        return -ENOMEM;
+
+    sector_lock_bits = kvcalloc(BITS_TO_LONGS(store.nr_sectors), sizeof(long), GFP_KERNEL);
+    scrub_suspect_bits = kvcalloc(BITS_TO_LONGS(store.nr_sectors), sizeof(long), GFP_KERNEL);
+    if (!sector_lock_bits || !scrub_suspect_bits)
+    {
+        ret = -ENOMEM;
+        goto err;
+    }
+
+    ret = comp_init();
+    if (ret)
+        goto err;
+    ret = dedup_init();
+    if (ret)
+        goto err_comp;
+    if (store_mode != STORE_PLAIN)
+    {
+        stripe_scratch = kmalloc_array(STORAGE_LOCK_STRIPES, STORAGE_SECTOR_SIZE, GFP_KERNEL);
+        if (!stripe_scratch)
+        {
+            ret = -ENOMEM;
+            goto err_dedup;
+        }
+    }
+    return 0;
+
+err_dedup:
+    dedup_exit();
+err_comp:
+    comp_exit();
+err:
+    kvfree(scrub_suspect_bits);
+    kvfree(sector_lock_bits);
+    kmem_cache_destroy(sector_cache);
+    return ret;
+}
+
+/*
+ * Copy-on-write snapshots. A snapshot only holds the sectors overwritten
+ * since it was taken: before a sector is first modified, a copy of its old
+ * contents goes into the newest snapshot's xarray (SNAP_ZERO_ENTRY if it
+ * was never written). Sector s of a snapshot is found in that snapshot,
+ * else in the next newer one and so on, else in the live store. Taking a
+ * snapshot links an empty xarray in with every stripe held for write, so it
+ * costs the same for 4K as for 64G. The list only changes with all stripes
+ * held, so anyone holding a stripe may walk it.
+ */
+#define STORAGE_MAX_SNAPSHOTS 16
+#define SNAP_ZERO_ENTRY       xa_mk_value(0)
+
+struct storage_snapshot
+{
+    struct list_head list;	/* in snapshots, oldest first */
+    char name[STORAGE_SNAP_NAME_LEN];
+    struct xarray preserved;
+    int users;			/* open /dev/storageSnap files */
+};
+
+static LIST_HEAD(snapshots);
+static unsigned int nr_snapshots;
+static DEFINE_MUTEX(snap_mutex);	/* create/delete, users */
+static atomic_long_t snap_nr_preserved;
+
+static void snap_entry_free(void *entry)
+{
+    if (!xa_is_value(entry))
+        kmem_cache_free(sector_cache, entry);
+    atomic_long_dec(&snap_nr_preserved);
+}
+
+/* Save sector for the newest snapshot before its first modification */
+static int snap_preserve(sector_t sector)
+{
+    struct storage_snapshot *snap;
+    const unsigned char *old;
+    unsigned char *copy = NULL;
+    void *entry = SNAP_ZERO_ENTRY;
+
+    if (list_empty(&snapshots))
+        return 0;
+    snap = list_last_entry(&snapshots, struct storage_snapshot, list);
+    if (xa_load(&snap->preserved, sector))
+        return 0;
+
+    /* Snapshot copies are kept uncompressed */
+    if (store_lookup(sector))
+    {
+        copy = kmem_cache_alloc(sector_cache, GFP_KERNEL);
+        if (!copy)
+            return -ENOMEM;
+        old = store_fetch(sector, copy);
+        if (old != copy)
+            memcpy(copy, old, STORAGE_SECTOR_SIZE);
+        entry = copy;
+    }
+    if (xa_is_err(xa_store(&snap->preserved, sector, entry, GFP_KERNEL)))
+    {
+        if (copy)
+            kmem_cache_free(sector_cache, copy);
+        return -ENOMEM;
+    }
+    atomic_long_inc(&snap_nr_preserved);
+    return 0;
+}
+
+/*
+ * Buffer to modify sector in, preserving it for the newest snapshot first;
+ * the stripe is held for write. Pass it to store_put() when done.
+ */
+static unsigned char *store_get_cow(sector_t sector)
+{
+    unsigned char *scratch;
+    const unsigned char *buf;
+
+    if (snap_preserve(sector))
+        return NULL;
+    if (store_mode == STORE_PLAIN)
+        return store_get(sector);
+
+    scratch = stripe_scratch + stripe_of(sector) * STORAGE_SECTOR_SIZE;
+    buf = store_fetch(sector, scratch);
+    if (!buf)
+        memset(scratch, 0, STORAGE_SECTOR_SIZE);
+    else if (buf != scratch)
+        memcpy(scratch, buf, STORAGE_SECTOR_SIZE);
+    return scratch;
+}
+
+/* Sector contents as of snap, or NULL for zeros; a stripe is held */
+static const unsigned char *snap_lookup(struct storage_snapshot *snap, sector_t sector,
+                                        unsigned char *scratch)
+{
+    list_for_each_entry_from(snap, &snapshots, list)
+    {
+        void *entry = xa_load(&snap->preserved, sector);
+
+        if (entry)
+            return xa_is_value(entry) ? NULL : entry;
+    }
+    return store_fetch(sector, scratch);
+}
+
+static struct storage_snapshot *snap_find(const char *name)
+{
+    struct storage_snapshot *snap;
+
+    list_for_each_entry(snap, &snapshots, list)
+    {
+        if (!strcmp(snap->name, name))
+            return snap;
+    }
+    return NULL;
+}
+
+static int snap_create(const char *name)
+{
+    struct storage_snapshot *snap;
+    int ret = 0;
+
+    if (!*name)
+        return -EINVAL;
+    snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+    if (!snap)
+        return -ENOMEM;
+    strscpy(snap->name, name, sizeof(snap->name));
+    xa_init(&snap->preserved);
+
+    mutex_lock(&snap_mutex);
+    if (snap_find(name))
+        ret = -EEXIST;
+    else if (nr_snapshots == STORAGE_MAX_SNAPSHOTS)
+        ret = -ENOSPC;
+    else
+    {
+        /* Waits out in-flight writes, so the snapshot is one point in time */
+        storage_lock_range(0, store.nr_sectors - 1, true);
+        list_add_tail(&snap->list, &snapshots);
+        storage_unlock_range(0, store.nr_sectors - 1, true);
+        nr_snapshots++;
+    }
+    mutex_unlock(&snap_mutex);
+
+    if (ret)
+    {
+        kfree(snap);
+        return ret;
+    }
+    pr_info("storageDevice: snapshot %s created\n", snap->name);
+    return 0;
+}
+
+/*
+ * Hand snap's sectors over to the next older snapshot where it has none of
+ * its own (the older snapshot saw the same contents), and free the rest.
+ * The older xarray's slots are reserved first so the hand-over can't fail
+ * halfway. Writers are held off for the whole walk.
+ */
+static int snap_merge_and_free(struct storage_snapshot *snap, struct storage_snapshot *older)
+{
+    unsigned long sector;
+    void *entry;
+
+    if (older)
+    {
+        xa_for_each(&snap->preserved, sector, entry)
+        {
+            if (xa_load(&older->preserved, sector))
+                continue;
+            if (xa_reserve(&older->preserved, sector, GFP_KERNEL))
+            {
+                xa_for_each(&snap->preserved, sector, entry)
+                    xa_release(&older->preserved, sector);
+                return -ENOMEM;
+            }
+        }
+    }
+
+    xa_for_each(&snap->preserved, sector, entry)
+    {
+        /* A reserved slot reads as NULL */
+        if (older && !xa_load(&older->preserved, sector))
+            xa_store(&older->preserved, sector, entry, GFP_KERNEL);
+        else
+            snap_entry_free(entry);
+    }
+    xa_destroy(&snap->preserved);
+    return 0;
+}
+
+static int snap_delete(const char *name)
+{
+    struct storage_snapshot *snap, *older = NULL;
+    int ret;
+
+    mutex_lock(&snap_mutex);
+    snap = snap_find(name);
+    if (!snap || snap->users)
+    {
+        mutex_unlock(&snap_mutex);
+        return snap ? -EBUSY : -ENOENT;
+    }
+    if (!list_is_first(&snap->list, &snapshots))
+        older = list_prev_entry(snap, list);
+
+    storage_lock_range(0, store.nr_sectors - 1, true);
+    ret = snap_merge_and_free(snap, older);
+    if (!ret)
+    {
+        list_del(&snap->list);
+        nr_snapshots--;
+    }
+    storage_unlock_range(0, store.nr_sectors - 1, true);
+    mutex_unlock(&snap_mutex);
+
+    if (ret)
+        return ret;
+    pr_info("storageDevice: snapshot %s deleted\n", name);
+    kfree(snap);
+    return 0;
+}
+
+/* Module unload, nothing can reach the snapshots any more */
+static void snap_free_all(void)
+{
+    struct storage_snapshot *snap, *tmp;
+    unsigned long sector;
+    void *entry;
+
+    list_for_each_entry_safe(snap, tmp, &snapshots, list)
+    {
+        xa_for_each(&snap->preserved, sector, entry)
+            snap_entry_free(entry);
+        xa_destroy(&snap->preserved);
+        list_del(&snap->list);
+        kfree(snap);
+    }
+    nr_snapshots = 0;
+}
+
+/*
+ * Asynchronous mirroring. Writers set a sector's bit in mirror_dirty_bits
+ * (with its stripe held for write) and kick mirror_work, which copies dirty
+ * sectors to the mirror in batches every mirror_interval_ms. The worker
+ * clears a bit before copying the sector under its stripe read lock, so a
+ * write racing with the copy leaves the bit set for the next pass.
+ * mirror_dirty_count is the replication lag shown in sysfs.
+ */
+#define MIRROR_BATCH_SECTORS 64
+
+static unsigned long *mirror_dirty_bits;
+static atomic_long_t mirror_dirty_count;
+static struct workqueue_struct *mirror_wq;
+static struct delayed_work mirror_work;
+static unsigned char *mirror_batch;	/* MIRROR_BATCH_SECTORS staged sectors */
+
+static void mirror_kick(void)
+{
+    queue_delayed_work(mirror_wq, &mirror_work,
+                       msecs_to_jiffies(READ_ONCE(mirror_interval_ms)));
+}
+
+static void storage_mark_dirty(sector_t first, sector_t last)
+{
+    sector_t s;
+
+    for (s = first; s <= last; s++)
+    {
+        /* Only the first dirty sector needs to arm the worker */
+        if (!test_and_set_bit(s, mirror_dirty_bits) &&
+            atomic_long_inc_return(&mirror_dirty_count) == 1)
+            mirror_kick();
+    }
+}
+
+/*
+ * Load the image parameter, a raw dump as IOCTL_BACKUP_TO_FILE writes it,
+ * into the empty store. The file is read a chunk at a time with
+ * sequential readahead and zero sectors stay unallocated. A shorter image
+ * leaves the rest of the device zero, a longer one is cut to capacity.
+ */
+#define STORAGE_IMAGE_CHUNK SZ_1M
+
+static int image_load(void)
+{
+    struct file *filp;
+    unsigned char *chunk;
+    loff_t pos = 0, size, end;
+    sector_t s = 0;
+    u64 start, elapsed;
+    int ret = 0;
+
+    if (!*image)
+        return 0;
+
+    filp = filp_open(image, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(filp))
+    {
+        pr_err("storageDevice: cannot open image %s\n", image);
+        return PTR_ERR(filp);
+    }
+    chunk = kvmalloc(STORAGE_IMAGE_CHUNK, GFP_KERNEL);
+    if (!chunk)
+    {
+        filp_close(filp, NULL);
+        return -ENOMEM;
+    }
+
+    size = i_size_read(file_inode(filp));
+    if (size != store.size)
+        pr_warn("storageDevice: image %s is %lld bytes, the device %lld\n",
+                image, (long long)size, (long long)store.size);
+    end = min_t(loff_t, round_down(size, STORAGE_SECTOR_SIZE), store.size);
+    vfs_fadvise(filp, 0, end, POSIX_FADV_SEQUENTIAL);
+
+    start = ktime_get_ns();
+    while (!ret && pos < end)
+    {
+        ssize_t rc = kernel_read(filp, chunk, min_t(loff_t, end - pos, STORAGE_IMAGE_CHUNK), &pos);
+        size_t off;
+
+        if (rc < STORAGE_SECTOR_SIZE)
+        {
+            ret = rc < 0 ? rc : -EIO;
+            break;
+        }
+        for (off = 0; off + STORAGE_SECTOR_SIZE <= rc; off += STORAGE_SECTOR_SIZE, s++)
+        {
+            if (!memchr_inv(chunk + off, 0, STORAGE_SECTOR_SIZE))
+                continue;
+            ret = store_write_sector(s, chunk + off);
+            if (ret)
+                break;
+            /* The mirror starts out empty */
+            storage_mark_dirty(s, s);
+        }
+        /* A short read may stop mid-sector, go on from its start */
+        pos = (loff_t)s << STORAGE_SECTOR_SHIFT;
+    }
+    elapsed = ktime_get_ns() - start;
+    kvfree(chunk);
+    filp_close(filp, NULL);
+
+    if (ret)
+    {
+        pr_err("storageDevice: loading image %s failed at sector %llu (%d)\n",
+               image, (unsigned long long)s, ret);
+        return ret;
+    }
+    pr_info("storageDevice: image %s loaded, %lld bytes, %ld sectors allocated in %llu ms (%llu MB/s)\n",
+            image, (long long)end, atomic_long_read(&store.nr_allocated),
+            div_u64(elapsed, NSEC_PER_MSEC),
+            div64_u64((u64)end * NSEC_PER_SEC, max_t(u64, elapsed, 1) * SZ_1M));
+    return 0;
+}
+
+/*
+ * Write-ahead journal. Every change to the store is logged as one record
+ * holding the new contents of the sectors it touched, or the range it
+ * erased. Records are queued in sequence under the stripe locks of the
+ * change, so the records of a sector stay in order. A multi-sector write
+ * is a single change: past JOURNAL_MAX_RECORD_SECTORS it is split into
+ * records with consecutive seqs, all but the last flagged continued, and
+ * replay applies it whole or, if it was torn by a crash, not at all.
+ * journal_work writes everything queued to the file
+ * every journal_interval_ms and commits it with one fsync (group commit);
+ * O_SYNC writes, fsync() and flushes on vblk0 kick it and wait.
+ *
+ * Once the file passes journal_max_mb, the worker checkpoints: it writes
+ * an image of the allocated sectors to the other file, ends it with a
+ * marker, fsyncs and switches files. A crash during a checkpoint leaves
+ * the old file as the newest complete one. At load the newer file with a
+ * complete checkpoint is replayed up to its first torn record.
+ */
+#define JOURNAL_CKPT_SECTORS 256	/* sectors per image record */
+#define JOURNAL_MAX_RECORD_SECTORS 2048	/* 1 MB, the most data in a record */
+
+struct journal_entry
+{
+    struct list_head list;
+    size_t len;		/* record and data */
+    struct storage_journal_record rec;
+    unsigned char data[];
+};
+
+static struct file *journal_filp;	/* NULL when journaling is off */
+static unsigned int journal_cur;	/* which of the two files journal_filp is */
+static loff_t journal_pos;
+static int journal_error;
+static LIST_HEAD(journal_pending);
+static DEFINE_SPINLOCK(journal_lock);	/* journal_pending, journal_seq */
+static u64 journal_seq;			/* last seq handed out */
+static atomic64_t journal_committed;	/* last seq on disk */
+static atomic_long_t journal_commits;
+static atomic_long_t journal_records;
+static DECLARE_WAIT_QUEUE_HEAD(journal_waitq);
+static struct workqueue_struct *journal_wq;
+static struct delayed_work journal_work;
+
+static void journal_discard(struct journal_entry *e)
+{
+    struct journal_entry *next, *tmp;
+
+    if (IS_ERR_OR_NULL(e))
+        return;
+    list_for_each_entry_safe(next, tmp, &e->list, list)
+        kvfree(next);
+    kvfree(e);
+}
+
+/*
+ * Entries for a change of nr sectors, taken before the store is touched so
+ * logging can't fail halfway: one per record, the others chained on the
+ * list of the first. NULL when journaling is off.
+ */
+static struct journal_entry *journal_alloc(sector_t nr)
+{
+    sector_t n = min_t(sector_t, nr, JOURNAL_MAX_RECORD_SECTORS);
+    struct journal_entry *e, *next;
+
+    if (!journal_filp)
+        return NULL;
+    e = kvmalloc(struct_size(e, data, n * STORAGE_SECTOR_SIZE), GFP_KERNEL);
+    if (!e)
+        return ERR_PTR(-ENOMEM);
+    INIT_LIST_HEAD(&e->list);
+
+    for (nr -= n; nr; nr -= n)
+    {
+        n = min_t(sector_t, nr, JOURNAL_MAX_RECORD_SECTORS);
+        next = kvmalloc(struct_size(next, data, n * STORAGE_SECTOR_SIZE), GFP_KERNEL);
+        if (!next)
+        {
+            journal_discard(e);
+            return ERR_PTR(-ENOMEM);
+        }
+        list_add_tail(&next->list, &e->list);
+        cond_resched();
+    }
+    return e;
+}
+
+/*
+ * Fill in the record for sectors first..last from the store, their stripes
+ * held, all but its seq; the crc is finished by journal_seal().
+ */
+static void journal_fill(struct journal_entry *e, sector_t first, sector_t last, u32 flags)
+{
+    struct storage_journal_record *rec = &e->rec;
+    unsigned char *dst = e->data;
+    sector_t s;
+
+    rec->magic = STORAGE_JOURNAL_MAGIC;
+    rec->first = first;
+    rec->count = flags & STORAGE_JOURNAL_CHECKPOINT ? 0 : last - first + 1;
+    rec->flags = flags;
+    e->len = sizeof(*rec);
+    if (!(flags & (STORAGE_JOURNAL_ERASE | STORAGE_JOURNAL_CHECKPOINT)))
+    {
+        e->len += (size_t)rec->count * STORAGE_SECTOR_SIZE;
+        for (s = first; s <= last; s++, dst += STORAGE_SECTOR_SIZE)
+        {
+            const unsigned char *buf = store_fetch(s, dst);
+
+            if (!buf)
+                memset(dst, 0, STORAGE_SECTOR_SIZE);
+            else if (buf != dst)
+                memcpy(dst, buf, STORAGE_SECTOR_SIZE);
+        }
+    }
+    rec->crc = crc32c(0, e->data, e->len - sizeof(*rec));
+}
+
+static u32 journal_crc(const struct storage_journal_record *rec, u32 data_crc)
+{
+    struct storage_journal_record hdr = *rec;
+
+    hdr.crc = 0;
+    return crc32c(data_crc, &hdr, sizeof(hdr));
+}
+
+static void journal_seal(struct journal_entry *e, u64 seq)
+{
+    e->rec.seq = seq;
+    e->rec.crc = journal_crc(&e->rec, e->rec.crc);
+}
+
+/*
+ * Queue the records of a change to sectors first..last, which the caller
+ * made with their stripes held for write. Seqs are handed out in queue
+ * order, consecutive within the change; entries of a write that came up
+ * short are freed. Returns the last seq for journal_sync(), 0 when
+ * journaling is off.
+ */
+static u64 journal_log(struct journal_entry *e, sector_t first, sector_t last, u32 flags)
+{
+    struct journal_entry *tmp;
+    unsigned int n = 0;
+    LIST_HEAD(txn);
+    sector_t end;
+    u64 seq = 0;
+
+    if (!e)
+        return 0;
+    list_splice_init(&e->list, &txn);
+    list_add(&e->list, &txn);
+    list_for_each_entry_safe(e, tmp, &txn, list)
+    {
+        if (first > last)
+        {
+            list_del(&e->list);
+            kvfree(e);
+            continue;
+        }
+        /* An erase carries no data, so it never needs splitting */
+        end = flags & STORAGE_JOURNAL_ERASE ? last :
+              min_t(sector_t, last, first + JOURNAL_MAX_RECORD_SECTORS - 1);
+        journal_fill(e, first, end, flags | (end < last ? STORAGE_JOURNAL_CONTINUED : 0));
+        first = end + 1;
+        n++;
+    }
+
+    spin_lock(&journal_lock);
+    list_for_each_entry(e, &txn, list)
+        journal_seal(e, seq = ++journal_seq);
+    list_splice_tail(&txn, &journal_pending);
+    spin_unlock(&journal_lock);
+    atomic_long_add(n, &journal_records);
+    queue_delayed_work(journal_wq, &journal_work, msecs_to_jiffies(READ_ONCE(journal_interval_ms)));
+    return seq;
+}
+
+/* Wait until record seq is on disk; -EIO once the journal has failed */
+static int journal_sync(u64 seq)
+{
+    if (!journal_filp || !seq)
+        return 0;
+    mod_delayed_work(journal_wq, &journal_work, 0);
+    wait_event(journal_waitq, atomic64_read(&journal_committed) >= seq || READ_ONCE(journal_error));
+    return atomic64_read(&journal_committed) >= seq ? 0 : -EIO;
+}
+
+/* Everything logged so far on disk, for fsync() and block layer flushes */
+int storage_flush(void)
+{
+    u64 seq;
+
+    spin_lock(&journal_lock);
+    seq = journal_seq;
+    spin_unlock(&journal_lock);
+    return journal_sync(seq);
+}
+EXPORT_SYMBOL(storage_flush);
+
+static int journal_write(struct file *filp, const void *buf, size_t len, loff_t *pos)
+{
+    size_t off = 0;
+
+    while (off < len)
+    {
+        ssize_t rc = kernel_write(filp, buf + off, len - off, pos);
+        if (rc < 0)
+            return rc;
+        if (rc == 0)
+            return -EIO;
+        off += rc;
+    }
+    return 0;
+}
+
+/* Write out a batch of queued records and commit them with one fsync */
+static int journal_commit(struct list_head *batch)
+{
+    struct journal_entry *e, *tmp;
+    int ret = READ_ONCE(journal_error);
+    u64 last = 0;
+
+    list_for_each_entry_safe(e, tmp, batch, list)
+    {
+        if (!ret)
+            ret = journal_write(journal_filp, &e->rec, e->len, &journal_pos);
+        last = e->rec.seq;
+        list_del(&e->list);
+        kvfree(e);
+    }
+    if (!ret && last)
+        ret = vfs_fsync(journal_filp, 1);
+    if (ret && !journal_error)
+    {
+        pr_err("storageDevice: journal write failed (%d), journaling stopped\n", ret);
+        WRITE_ONCE(journal_error, ret);
+    }
+    else if (!ret && last)
+    {
+        atomic64_set(&journal_committed, last);
+        atomic_long_inc(&journal_commits);
+    }
+    wake_up_all(&journal_waitq);
+    return ret;
+}
+
+static char *journal_path(unsigned int i)
+{
+    return kasprintf(GFP_KERNEL, "%s.%u", journal, i);
+}
+
+/*
+ * Checkpoint into the other file: image records of every allocated run of
+ * sectors, each taken under its stripe read locks while writers carry on,
+ * then the marker. Changes queued from here on get seqs above the
+ * checkpoint's and go to the new file; earlier ones are committed to the
+ * old file first.
+ */
+static int journal_checkpoint(void)
+{
+    unsigned int next = !journal_cur;
+    sector_t s = 0, last = store.nr_sectors - 1;
+    struct journal_entry *e;
+    struct file *filp, *old;
+    LIST_HEAD(batch);
+    loff_t pos = 0;
+    char *path;
+    u64 seq;
+    int ret;
+
+    e = kvmalloc(struct_size(e, data, JOURNAL_CKPT_SECTORS * STORAGE_SECTOR_SIZE), GFP_KERNEL);
+    path = journal_path(next);
+    if (!e || !path)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+    filp = filp_open(path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(filp))
+    {
+        ret = PTR_ERR(filp);
+        goto out;
+    }
+
+    spin_lock(&journal_lock);
+    list_splice_init(&journal_pending, &batch);
+    seq = ++journal_seq;
+    spin_unlock(&journal_lock);
+    ret = journal_commit(&batch);
+    if (!ret)
+    {
+        /* Everything before the checkpoint's seq is on disk, and it logs no change */
+        atomic64_set(&journal_committed, seq);
+        wake_up_all(&journal_waitq);
+    }
+
+    while (!ret)
+    {
+        unsigned long first = s;
+        sector_t end;
+
+        if (!xa_find(&store.sectors, &first, last, XA_PRESENT))
+            break;
+        end = min_t(sector_t, first + JOURNAL_CKPT_SECTORS - 1, last);
+        storage_lock_range(first, end, false);
+        journal_fill(e, first, end, STORAGE_JOURNAL_IMAGE);
+        storage_unlock_range(first, end, false);
+        journal_seal(e, seq);
+        ret = journal_write(filp, &e->rec, e->len, &pos);
+        if (end == last)
+            break;
+        s = end + 1;
+        cond_resched();
+    }
+    if (!ret)
+    {
+        journal_fill(e, 0, 0, STORAGE_JOURNAL_CHECKPOINT);
+        journal_seal(e, seq);
+        ret = journal_write(filp, &e->rec, e->len, &pos);
+    }
+    if (!ret)
+        ret = vfs_fsync(filp, 1);
+    if (ret)
+    {
+        /* Without its marker the new file is ignored at load */
+        filp_close(filp, NULL);
+        goto out;
+    }
+
+    old = journal_filp;
+    journal_filp = filp;
+    journal_pos = pos;
+    journal_cur = next;
+    vfs_truncate(&old->f_path, 0);
+    filp_close(old, NULL);
+    pr_info("storageDevice: journal checkpointed to %s (%lld bytes)\n", path, (long long)pos);
+out:
+    if (ret)
+        pr_warn_ratelimited("storageDevice: journal checkpoint failed (%d)\n", ret);
+    kfree(path);
+    kvfree(e);
+    return ret;
+}
+
+static void journal_work_fn(struct work_struct *work)
+{
+    LIST_HEAD(batch);
+
+    spin_lock(&journal_lock);
+    list_splice_init(&journal_pending, &batch);
+    spin_unlock(&journal_lock);
+
+    if (!journal_commit(&batch) &&
+        journal_pos > ((loff_t)READ_ONCE(journal_max_mb) << 20))
+        journal_checkpoint();
+}
+
+/* Where replaying a journal file got to */
+struct journal_replay
+{
+    u64 ckpt_seq;		/* 0 without a complete checkpoint */
+    u64 last_seq;
+    loff_t end;			/* just past the last valid record */
+    unsigned long records;
+};
+
+/*
+ * Read the record at *pos into *ep, growing it to fit. false at the end
+ * of the file or at a record that is torn or doesn't fit this store; the
+ * header is checked against what a writer can produce and what is left
+ * of the file before anything is allocated for the data.
+ */
+static bool journal_read(struct file *filp, loff_t *pos, struct journal_entry **ep, size_t *sizep)
+{
+    struct storage_journal_record rec;
+    struct journal_entry *e = *ep;
+    size_t len;
+
+    if (kernel_read(filp, &rec, sizeof(rec), pos) != sizeof(rec) ||
+        rec.magic != STORAGE_JOURNAL_MAGIC ||
+        rec.first > store.nr_sectors || rec.count > store.nr_sectors - rec.first)
+        return false;
+
+    len = rec.flags & STORAGE_JOURNAL_ERASE ? 0 : (size_t)rec.count * STORAGE_SECTOR_SIZE;
+    if (len > JOURNAL_MAX_RECORD_SECTORS * STORAGE_SECTOR_SIZE ||
+        (loff_t)len > i_size_read(file_inode(filp)) - *pos)
+        return false;
+    if (struct_size(e, data, len) > *sizep)
+    {
+        kvfree(e);
+        *sizep = struct_size(e, data, len);
+        *ep = e = kvmalloc(*sizep, GFP_KERNEL);
+        if (!e)
+        {
+            *sizep = 0;
+            return false;
+        }
+    }
+    e->rec = rec;
+    if (len && kernel_read(filp, e->data, len, pos) != len)
+        return false;
+    return journal_crc(&rec, crc32c(0, e->data, len)) == rec.crc;
+}
+
+/* Replay one record into the store, at load with nothing else running */
+static int journal_apply(const struct journal_entry *e)
+{
+    const struct storage_journal_record *rec = &e->rec;
+    const unsigned char *src = e->data;
+    sector_t s;
+    u32 i;
+
+    for (i = 0; i < rec->count; i++, src += STORAGE_SECTOR_SIZE)
+    {
+        s = rec->first + i;
+        if ((rec->flags & STORAGE_JOURNAL_ERASE) || !memchr_inv(src, 0, STORAGE_SECTOR_SIZE))
+        {
+            if (store_lookup(s))
+                store_drop(s);
+        }
+        else if (store_write_sector(s, src))
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * Walk a journal file: its checkpoint, all records carrying the
+ * checkpoint's seq and ending with the marker, then changes with rising
+ * seqs, r->end just past the last one that is complete. Applies the
+ * records up to apply_end to the store, which a walk with apply_end 0
+ * found first: the records of a torn change are never applied.
+ */
+static int journal_replay_file(struct file *filp, loff_t apply_end, struct journal_replay *r)
+{
+    struct journal_entry *e = NULL;
+    size_t size = 0;
+    loff_t pos = 0;
+    u64 ckpt = 0;
+    u64 seq = 0;	/* last walked, in a change maybe not complete */
+    int ret = 0;
+
+    memset(r, 0, sizeof(*r));
+    while (journal_read(filp, &pos, &e, &size))
+    {
+        const struct storage_journal_record *rec = &e->rec;
+
+        if (!r->ckpt_seq)
+        {
+            if (!ckpt)
+                ckpt = rec->seq;
+            if (rec->seq != ckpt || !(rec->flags & (STORAGE_JOURNAL_IMAGE | STORAGE_JOURNAL_CHECKPOINT)))
+                break;
+            if (rec->flags & STORAGE_JOURNAL_CHECKPOINT)
+                r->ckpt_seq = seq = ckpt;
+        }
+        else if (rec->seq <= seq || (rec->flags & (STORAGE_JOURNAL_IMAGE | STORAGE_JOURNAL_CHECKPOINT)))
+            break;
+        else
+            seq = rec->seq;
+
+        if (apply_end)
+        {
+            if (pos > apply_end)
+                break;
+            ret = journal_apply(e);
+            if (ret)
+                break;
+        }
+        r->records++;
+        if (!(rec->flags & STORAGE_JOURNAL_CONTINUED))
+        {
+            r->end = pos;
+            r->last_seq = seq;
+        }
+    }
+    kvfree(e);
+    return ret;
+}
+
+/* Replay the newer journal file with a complete checkpoint, or start one from the image */
+static int journal_init(void)
+{
+    struct journal_replay r, best = { 0 };
+    unsigned int i, cur = 0;
+    struct file *filp;
+    unsigned long sector;
+    void *buf;
+    char *path;
+    u64 start;
+    int ret = 0;
+
+    if (!*journal)
+        return image_load();
+
+    journal_wq = alloc_workqueue("storage_journal", WQ_UNBOUND, 1);
+    if (!journal_wq)
+        return -ENOMEM;
+    INIT_DELAYED_WORK(&journal_work, journal_work_fn);
+
+    for (i = 0; i < 2 && !ret; i++)
+    {
+        path = journal_path(i);
+        if (!path)
+            return -ENOMEM;
+        filp = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+        kfree(path);
+        if (IS_ERR(filp))
+            continue;
+        ret = journal_replay_file(filp, 0, &r);
+        filp_close(filp, NULL);
+        if (r.ckpt_seq > best.ckpt_seq)
+        {
+            best = r;
+            cur = i;
+        }
+    }
+    if (ret)
+        return ret;
+
+    /* Without a usable file the other one starts as current, see below */
+    path = journal_path(best.ckpt_seq ? cur : 1);
+    if (!path)
+        return -ENOMEM;
+    filp = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE | (best.ckpt_seq ? 0 : O_TRUNC), 0600);
+    kfree(path);
+    if (IS_ERR(filp))
+        return PTR_ERR(filp);
+
+    if (!best.ckpt_seq)
+    {
+        /* Fresh journal: its first checkpoint, into file 0, takes the image */
+        ret = image_load();
+        if (ret)
+        {
+            filp_close(filp, NULL);
+            return ret;
+        }
+        journal_filp = filp;
+        journal_cur = 1;
+        ret = journal_checkpoint();
+        if (ret)
+        {
+            filp_close(journal_filp, NULL);
+            journal_filp = NULL;
+        }
+        return ret;
+    }
+
+    if (*image)
+        pr_info("storageDevice: image %s not loaded, journal %s.%u is newer\n", image, journal, cur);
+    start = ktime_get_ns();
+    ret = journal_replay_file(filp, best.end, &r);
+    if (ret)
+    {
+        filp_close(filp, NULL);
+        return ret;
+    }
+    /* Drop a torn tail so new records follow the last good one */
+    vfs_truncate(&filp->f_path, r.end);
+    journal_filp = filp;
+    journal_cur = cur;
+    journal_pos = r.end;
+    journal_seq = r.last_seq;
+    atomic64_set(&journal_committed, r.last_seq);
+
+    /* The mirror starts out empty */
+    xa_for_each(&store.sectors, sector, buf)
+        storage_mark_dirty(sector, sector);
+    pr_info("storageDevice: journal %s.%u replayed, %lu records, %ld sectors in %llu ms\n",
+            journal, cur, r.records, atomic_long_read(&store.nr_allocated),
+            div_u64(ktime_get_ns() - start, NSEC_PER_MSEC));
+    return 0;
+}
+
+/* Commit whatever is still queued and close the journal */
+static void journal_exit(void)
+{
+    LIST_HEAD(batch);
+
+    if (!journal_wq)
+        return;
+    cancel_delayed_work_sync(&journal_work);
+    if (journal_filp)
+    {
+        list_splice_init(&journal_pending, &batch);
+        journal_commit(&batch);
+        filp_close(journal_filp, NULL);
+        journal_filp = NULL;
+    }
+    destroy_workqueue(journal_wq);
+    journal_wq = NULL;
+}
+
+/*
+ * mmap() of /dev/storageDevice. The store has no linear backing to map, so
+ * each page of a mapping is assembled from its sectors on first fault and
+ * kept in mmap_pages. A page is exactly one stripe run: whoever holds the
+ * stripe of one of its sectors holds the whole page. Pages are mapped
+ * read-only until page_mkwrite, which refuses the write with SIGBUS if a
+ * sector in the page is locked and otherwise tags the page dirty.
+ *
+ * Dirty pages are written back by IOCTL_MMAP_SYNC, by a lock covering
+ * them, and by any write or erase covering them before it touches the
+ * store: the page is unmapped from every process, its changed sectors are
+ * stored and marked dirty for the mirror, and the next access faults it in
+ * again. Writers drop the clean pages they cover afterwards. Everything is
+ * written back once nothing maps the store and the device is closed.
+ * Other readers see writes made through a mapping once written back.
+ *
+ * The fault handlers take stripes, so nothing may fault on user memory
+ * with a stripe held: the read and write paths copy with page faults
+ * disabled and fault the user buffer in between attempts.
+ */
+#define MMAP_PAGE_DIRTY XA_MARK_0
+
+static DEFINE_XARRAY(mmap_pages);
+static DEFINE_MUTEX(mmap_mutex);	/* mmap_mapping against storage_mmap() */
+static struct address_space *mmap_mapping;	/* device inode being mapped */
+static atomic_t mmap_count = ATOMIC_INIT(0);	/* vmas mapping the store */
+
+/*
+ * Unmap and free a mapped page; its stripe is held for write. The page
+ * lock keeps a fault that found the page from mapping it after the unmap.
+ */
+static void mmap_drop_page(pgoff_t index, struct page *page)
+{
+    lock_page(page);
+    unmap_mapping_range(mmap_mapping, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, 1);
+    xa_erase(&mmap_pages, index);
+    unlock_page(page);
+    put_page(page);
+}
+
+/* Store a dirty page's changed sectors and drop it */
+static int mmap_writeback_page(pgoff_t index, struct page *page)
+{
+    sector_t first = (sector_t)index * STORAGE_STRIPE_SECTORS;
+    sector_t last = min_t(sector_t, first + STORAGE_STRIPE_SECTORS, store.nr_sectors) - 1;
+    const unsigned char *src = page_address(page);
+    struct journal_entry *je = journal_alloc(last - first + 1);
+    unsigned char *scratch = NULL;
+    bool changed = false;
+    sector_t s;
+    int ret = 0;
+
+    if (IS_ERR(je))
+        return PTR_ERR(je);
+
+    /* No more writes through the mapping while the sectors are copied */
+    unmap_mapping_range(mmap_mapping, (loff_t)index << PAGE_SHIFT, PAGE_SIZE, 1);
+    if (stripe_scratch)
+        scratch = stripe_scratch + stripe_of(first) * STORAGE_SECTOR_SIZE;
+    for (s = first; s <= last; s++, src += STORAGE_SECTOR_SIZE)
+    {
+        const unsigned char *cur;
+
+        /* Mapped writes to a sector locked since page_mkwrite are dropped */
+        if (test_bit(s, sector_lock_bits))
+            continue;
+        cur = store_fetch(s, scratch);
+        if (cur ? !memcmp(cur, src, STORAGE_SECTOR_SIZE) :
+                  !memchr_inv(src, 0, STORAGE_SECTOR_SIZE))
+            continue;
+        ret = snap_preserve(s);
+        if (!ret)
+            ret = store_write_sector(s, src);
+        /* The page stays dirty, so the next write back retries */
+        if (ret)
+            break;
+        storage_mark_dirty(s, s);
+        changed = true;
+    }
+    if (changed)
+        journal_log(je, first, last, 0);
+    else
+        journal_discard(je);
+    if (!ret)
+        mmap_drop_page(index, page);
+    return ret;
+}
+
+/* Write back the dirty mapped pages over sectors first..last, held for write */
+static int mmap_writeback_range(sector_t first, sector_t last)
+{
+    unsigned long index;
+    struct page *page;
+    int ret;
+
+    if (xa_empty(&mmap_pages))
+        return 0;
+    xa_for_each_range(&mmap_pages, index, page, first / STORAGE_STRIPE_SECTORS,
+                      last / STORAGE_STRIPE_SECTORS)
+    {
+        if (!xa_get_mark(&mmap_pages, index, MMAP_PAGE_DIRTY))
+            continue;
+        ret = mmap_writeback_page(index, page);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+/* Drop the clean mapped pages over sectors first..last after writing them */
+static void mmap_invalidate_range(sector_t first, sector_t last)
+{
+    unsigned long index;
+    struct page *page;
+
+    if (xa_empty(&mmap_pages))
+        return;
+    xa_for_each_range(&mmap_pages, index, page, first / STORAGE_STRIPE_SECTORS,
+                      last / STORAGE_STRIPE_SECTORS)
+    {
+        if (!xa_get_mark(&mmap_pages, index, MMAP_PAGE_DIRTY))
+            mmap_drop_page(index, page);
+    }
+}
+
+sector_t storage_nr_sectors(void)
+{
+    return store.nr_sectors;
+}
+EXPORT_SYMBOL(storage_nr_sectors);
+
+/*
+ * Kernel-buffer reads for the block frontend; unwritten sectors give zeros.
+ * -EIO if a sector fails its checksum. Whole compressed sectors are
+ * decompressed straight into dst, only partial ones need a bounce buffer.
+ */
+int storage_copy_out(loff_t pos, void *dst, size_t len)
+{
+    unsigned char *bounce = NULL;
+    int ret = 0;
+
+    while (len)
+    {
+        size_t off = pos & (STORAGE_SECTOR_SIZE - 1);
+        size_t chunk = min_t(size_t, len, STORAGE_SECTOR_SIZE - off);
+        unsigned char *scratch = dst;
+        const unsigned char *buf;
+
+        if (store_mode == STORE_COMPRESSED && chunk != STORAGE_SECTOR_SIZE)
+        {
+            if (!bounce)
+                bounce = kmalloc(STORAGE_SECTOR_SIZE, GFP_KERNEL);
+            if (!bounce)
+            {
+                ret = -ENOMEM;
+                break;
+            }
+            scratch = bounce;
+        }
+        if (store_read_sector(pos >> STORAGE_SECTOR_SHIFT, scratch, &buf))
+        {
+            ret = -EIO;
+            break;
+        }
+        if (!buf)
+            memset(dst, 0, chunk);
+        else if (buf != dst)
+            memcpy(dst, buf + off, chunk);
+        dst += chunk;
+        pos += chunk;
+        len -= chunk;
+    }
+    kfree(bounce);
+    return ret;
+}
+EXPORT_SYMBOL(storage_copy_out);
+
+/*
+ * Kernel-buffer writes, allocating sectors as needed; -ENOMEM if that
+ * fails. All of from goes in as one change in the journal, so the segments
+ * of a block request are replayed together or not at all.
+ */
+int storage_copy_in_iter(loff_t pos, struct iov_iter *from)
+{
+    size_t len = iov_iter_count(from);
+    sector_t first = pos >> STORAGE_SECTOR_SHIFT;
+    sector_t last = (pos + len - 1) >> STORAGE_SECTOR_SHIFT;
+    struct journal_entry *je;
+    int ret;
+
+    if (!len)
+        return 0;
+    ret = mmap_writeback_range(first, last);
+    if (ret)
+        return ret;
+    je = journal_alloc(last - first + 1);
+    if (IS_ERR(je))
+        return PTR_ERR(je);
+
+    while (len)
+    {
+        size_t off = pos & (STORAGE_SECTOR_SIZE - 1);
+        size_t chunk = min_t(size_t, len, STORAGE_SECTOR_SIZE - off);
+        unsigned char *buf = store_get_cow(pos >> STORAGE_SECTOR_SHIFT);
+        size_t copied;
+
+        if (!buf)
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        copied = copy_from_iter(buf + off, chunk, from);
+        if (store_put(pos >> STORAGE_SECTOR_SHIFT, buf))
+        {
+            ret = -ENOMEM;
+            break;
+        }
+        storage_mark_dirty(pos >> STORAGE_SECTOR_SHIFT, pos >> STORAGE_SECTOR_SHIFT);
+        pos += copied;
+        len -= copied;
+        if (copied != chunk)
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    if (pos > (loff_t)first << STORAGE_SECTOR_SHIFT)
+        journal_log(je, first, (pos - 1) >> STORAGE_SECTOR_SHIFT, 0);
+    else
+        journal_discard(je);
+    mmap_invalidate_range(first, last);
+    return ret;
+}
+EXPORT_SYMBOL(storage_copy_in_iter);
+
+int storage_copy_in(loff_t pos, const void *src, size_t len)
+{
+    struct kvec kv = { .iov_base = (void *)src, .iov_len = len };
+    struct iov_iter from;
+
+    iov_iter_kvec(&from, WRITE, &kv, 1, len);
+    return storage_copy_in_iter(pos, &from);
+}
+EXPORT_SYMBOL(storage_copy_in);
+
+/*
+ * Erase sectors first..last and hand their memory back, preserving them for
+ * the newest snapshot first. Only sectors holding data are visited, so the
+ * cost follows what is allocated, not the size of the range. The caller
+ * holds the stripes for write and has checked the sector locks.
+ */
+int storage_erase_range(sector_t first, sector_t last)
+{
+    struct journal_entry *je;
+    unsigned long sector;
+    sector_t end = last;
+    void *buf;
+    int ret;
+
+    ret = mmap_writeback_range(first, last);
+    if (ret)
+        return ret;
+    je = journal_alloc(0);
+    if (IS_ERR(je))
+        return PTR_ERR(je);
+
+    xa_for_each_range(&store.sectors, sector, buf, first, last)
+    {
+        ret = snap_preserve(sector);
+        if (ret)
+        {
+            end = sector - 1;
+            break;
+        }
+        store_drop(sector);
+        /* The mirror may still hold the old contents */
+        storage_mark_dirty(sector, sector);
+    }
+    if (end + 1 > first)
+        journal_log(je, first, end, STORAGE_JOURNAL_ERASE);
+    else
+        journal_discard(je);
+    mmap_invalidate_range(first, last);
+    return ret;
+}
+EXPORT_SYMBOL(storage_erase_range);
+
+static void mirror_flush_batch(const sector_t *sectors, unsigned int n)
+{
+    unsigned int i;
+
+    if (!mirror_write_batch(sectors, mirror_batch, n))
+        return;
+    /* Mirror out of memory: leave them dirty and try again next pass */
+    for (i = 0; i < n; i++)
+        storage_mark_dirty(sectors[i], sectors[i]);
+}
+
+static void mirror_work_fn(struct work_struct *work)
+{
+    sector_t sectors[MIRROR_BATCH_SECTORS];
+    unsigned int n = 0;
+    unsigned long s;
+    int ret;
+
+    for (s = find_next_bit(mirror_dirty_bits, store.nr_sectors, 0); s < store.nr_sectors;
+         s = find_next_bit(mirror_dirty_bits, store.nr_sectors, s + 1))
+    {
+        if (!test_and_clear_bit(s, mirror_dirty_bits))
+            continue;
+        atomic_long_dec(&mirror_dirty_count);
+
+        storage_lock_range(s, s, false);
+        ret = storage_copy_out((loff_t)s << STORAGE_SECTOR_SHIFT,
+                               mirror_batch + n * STORAGE_SECTOR_SIZE, STORAGE_SECTOR_SIZE);
+        storage_unlock_range(s, s, false);
+        /* Never replicate a corrupt sector, the scrubber repairs it from the mirror */
+        if (ret)
+            continue;
+
+        sectors[n++] = s;
+        if (n == MIRROR_BATCH_SECTORS)
+        {
+            mirror_flush_batch(sectors, n);
+            n = 0;
+            cond_resched();
+        }
+    }
+    if (n)
+        mirror_flush_batch(sectors, n);
+
+    /* Writes that landed behind the scan */
+    if (atomic_long_read(&mirror_dirty_count))
+        mirror_kick();
+}
+
+/* Push every dirty sector to the mirror now and wait for it */
+static void mirror_sync(void)
+{
+    mod_delayed_work(mirror_wq, &mirror_work, 0);
+    flush_delayed_work(&mirror_work);
+}
+
+static int mirror_repl_init(void)
+{
+    int ret;
+
+    ret = mirror_set_capacity(store.nr_sectors);
+    if (ret)
+        return ret;
+
+    mirror_dirty_bits = kvcalloc(BITS_TO_LONGS(store.nr_sectors), sizeof(long), GFP_KERNEL);
+    mirror_batch = kmalloc(MIRROR_BATCH_SECTORS * STORAGE_SECTOR_SIZE, GFP_KERNEL);
+    mirror_wq = alloc_workqueue("storage_mirror", WQ_UNBOUND, 1);
+    if (!mirror_dirty_bits || !mirror_batch || !mirror_wq)
+    {
+        if (mirror_wq)
+            destroy_workqueue(mirror_wq);
+        kfree(mirror_batch);
+        kvfree(mirror_dirty_bits);
+        return -ENOMEM;
+    }
+    atomic_long_set(&mirror_dirty_count, 0);
+    INIT_DELAYED_WORK(&mirror_work, mirror_work_fn);
+    return 0;
+}
+
+/* Called once nothing can write any more: flush what is left, then stop */
+static void mirror_repl_exit(void)
+{
+    mirror_sync();
+    cancel_delayed_work_sync(&mirror_work);
+    destroy_workqueue(mirror_wq);
+    kfree(mirror_batch);
+    kvfree(mirror_dirty_bits);
+}
+
+/*
+ * Background scrubber. A nice 19 kthread walks the allocated sectors,
+ * scrub_rate a second, comparing each with its mirror copy. The stored
+ * checksum decides which copy is good: a bad mirror copy is rewritten from
+ * the primary, a bad primary sector from the mirror. Sectors still waiting
+ * for replication are left for a later pass. The check only takes the
+ * stripe for read; the write lock is taken just to repair the primary.
+ */
+#define SCRUB_BATCH 32	/* sectors between sleeps */
+
+static atomic_long_t scrub_repaired;
+static atomic_long_t scrub_unrecoverable;
+static atomic_long_t scrub_passes;
+static unsigned char *scrub_buf;	/* the mirror copy, then a decompressed sector */
+
+static void scrub_sector(sector_t s, unsigned char *copy, unsigned char *scratch)
+{
+    const unsigned char *buf;
+
+    storage_lock_range(s, s, false);
+    if (test_bit(s, mirror_dirty_bits))
+    {
+        storage_unlock_range(s, s, false);
+        return;
+    }
+    buf = store_fetch(s, scratch);
+    if (!buf || store_csum_ok(s, buf))
+    {
+        const unsigned char *good = buf ? buf : zero_sector;
+
+        if (!mirror_fetch_sector(s, copy) && memcmp(copy, good, STORAGE_SECTOR_SIZE) &&
+            !mirror_write_batch(&s, good, 1))
+        {
+            atomic_long_inc(&scrub_repaired);
+            pr_warn_ratelimited("storageDevice: mirror copy of sector %llu repaired\n",
+                                (unsigned long long)s);
+        }
+        storage_unlock_range(s, s, false);
+        return;
+    }
+    storage_unlock_range(s, s, false);
+
+    storage_lock_range(s, s, true);
+    buf = store_fetch(s, scratch);
+    if (buf && !store_csum_ok(s, buf))
+    {
+        if (!mirror_fetch_sector(s, copy) && store_csum_ok(s, copy) &&
+            !store_write_sector(s, copy))
+        {
+            atomic_long_inc(&scrub_repaired);
+            pr_warn_ratelimited("storageDevice: sector %llu repaired from the mirror\n",
+                                (unsigned long long)s);
+        }
+        else
+        {
+            atomic_long_inc(&scrub_unrecoverable);
+            pr_err_ratelimited("storageDevice: sector %llu is bad in both copies\n",
+                               (unsigned long long)s);
+        }
+    }
+    storage_unlock_range(s, s, true);
+}
+
+static int scrub_thread_fn(void *data)
+{
+    unsigned long next = 0;
+
+    set_user_nice(current, MAX_NICE);
+    while (!kthread_should_stop())
+    {
+        unsigned int rate = READ_ONCE(scrub_rate);
+        unsigned int n;
+
+        for (n = 0; rate && n < SCRUB_BATCH; n++)
+        {
+            /* Sectors that just failed a read go first */
+            unsigned long s = find_first_bit(scrub_suspect_bits, store.nr_sectors);
+
+            if (s < store.nr_sectors)
+                clear_bit(s, scrub_suspect_bits);
+            else
+            {
+                s = next;
+                if (!xa_find(&store.sectors, &s, store.nr_sectors - 1, XA_PRESENT))
+                {
+                    next = 0;
+                    atomic_long_inc(&scrub_passes);
+                    break;
+                }
+                next = s + 1;
+            }
+            scrub_sector(s, scrub_buf, scrub_buf + STORAGE_SECTOR_SIZE);
+        }
+
+        /* Paused: look at scrub_rate again in a second */
+        schedule_timeout_interruptible(rate ? max(msecs_to_jiffies(SCRUB_BATCH * 1000 / rate), 1UL) : HZ);
+    }
+    return 0;
+}
+
+static int scrub_start(void)
+{
+    scrub_buf = kmalloc(2 * STORAGE_SECTOR_SIZE, GFP_KERNEL);
+    if (!scrub_buf)
+        return -ENOMEM;
+    scrub_task = kthread_run(scrub_thread_fn, NULL, "storage_scrub");
+    if (IS_ERR(scrub_task))
+    {
+        int ret = PTR_ERR(scrub_task);
+
+        scrub_task = NULL;
+        kfree(scrub_buf);
+        return ret;
+    }
+    return 0;
+}
+
+static void scrub_stop(void)
+{
+    kthread_stop(scrub_task);
+    scrub_task = NULL;
+    kfree(scrub_buf);
+}
+
+static ssize_t mirror_lag_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&mirror_dirty_count));
+}
+
+static ssize_t allocated_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&store.nr_allocated));
+}
+
+static ssize_t snapshots_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    struct storage_snapshot *snap;
+    ssize_t len = 0;
+
+    mutex_lock(&snap_mutex);
+    list_for_each_entry(snap, &snapshots, list)
+        len += sprintf(buf + len, "%s\n", snap->name);
+    mutex_unlock(&snap_mutex);
+    return len;
+}
+
+static ssize_t snapshot_sectors_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&snap_nr_preserved));
+}
+
+static ssize_t checksum_errors_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&csum_errors));
+}
+
+static ssize_t scrub_repaired_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&scrub_repaired));
+}
+
+static ssize_t scrub_unrecoverable_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&scrub_unrecoverable));
+}
+
+static ssize_t scrub_passes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&scrub_passes));
+}
+
+static ssize_t journal_records_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&journal_records));
+}
+
+/* Group commits, each one fsync: journal_records / journal_commits per commit */
+static ssize_t journal_commits_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&journal_commits));
+}
+
+/* Logical bytes held per byte of memory, in hundredths */
+static ssize_t compression_ratio_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    long stored = atomic_long_read(&comp_bytes);
+    long logical = atomic_long_read(&store.nr_allocated) * STORAGE_SECTOR_SIZE;
+    long ratio = store_mode == STORE_COMPRESSED && stored ? logical * 100 / stored : 100;
+
+    return sprintf(buf, "%ld.%02ld\n", ratio / 100, ratio % 100);
+}
+
+/* Distinct sector contents per sector held, in hundredths */
+static ssize_t dedup_ratio_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    long unique = atomic_long_read(&dedup_unique);
+    long logical = atomic_long_read(&store.nr_allocated);
+    long ratio = store_mode == STORE_DEDUP && logical ? unique * 100 / logical : 100;
+
+    return sprintf(buf, "%ld.%02ld\n", ratio / 100, ratio % 100);
+}
+
+static ssize_t dedup_unique_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&dedup_unique));
+}
+
+static ssize_t compressed_bytes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%ld\n", atomic_long_read(&comp_bytes));
+}
+
+static struct kobj_attribute mirror_lag_attr = __ATTR(mirror_lag_sectors, 0444, mirror_lag_show, NULL);
+static struct kobj_attribute allocated_attr = __ATTR(allocated_sectors, 0444, allocated_show, NULL);
+static struct kobj_attribute snapshots_attr = __ATTR(snapshots, 0444, snapshots_show, NULL);
+static struct kobj_attribute snapshot_sectors_attr = __ATTR(snapshot_sectors, 0444, snapshot_sectors_show, NULL);
+static struct kobj_attribute compression_ratio_attr = __ATTR(compression_ratio, 0444, compression_ratio_show, NULL);
+static struct kobj_attribute compressed_bytes_attr = __ATTR(compressed_bytes, 0444, compressed_bytes_show, NULL);
+static struct kobj_attribute dedup_ratio_attr = __ATTR(dedup_ratio, 0444, dedup_ratio_show, NULL);
+static struct kobj_attribute dedup_unique_attr = __ATTR(dedup_unique_sectors, 0444, dedup_unique_show, NULL);
+static struct kobj_attribute checksum_errors_attr = __ATTR(checksum_errors, 0444, checksum_errors_show, NULL);
+static struct kobj_attribute scrub_repaired_attr = __ATTR(scrub_repaired, 0444, scrub_repaired_show, NULL);
+static struct kobj_attribute scrub_unrecoverable_attr = __ATTR(scrub_unrecoverable, 0444, scrub_unrecoverable_show, NULL);
+static struct kobj_attribute scrub_passes_attr = __ATTR(scrub_passes, 0444, scrub_passes_show, NULL);
+static struct kobj_attribute journal_records_attr = __ATTR(journal_records, 0444, journal_records_show, NULL);
+static struct kobj_attribute journal_commits_attr = __ATTR(journal_commits, 0444, journal_commits_show, NULL);
+
+static struct attribute *storage_attrs[] = {
+    &mirror_lag_attr.attr,
+    &allocated_attr.attr,
+    &snapshots_attr.attr,
+    &snapshot_sectors_attr.attr,
+    &compression_ratio_attr.attr,
+    &compressed_bytes_attr.attr,
+    &dedup_ratio_attr.attr,
+    &dedup_unique_attr.attr,
+    &checksum_errors_attr.attr,
+    &scrub_repaired_attr.attr,
+    &scrub_unrecoverable_attr.attr,
+    &scrub_passes_attr.attr,
+    &journal_records_attr.attr,
+    &journal_commits_attr.attr,
+    NULL,
+};
+
+static struct attribute_group storage_attr_group = {
+    .attrs = storage_attrs,
+};
+
+static struct kobject *storage_kobj;
+
+static void store_free(void)
+{
+    struct storage_acl *acl, *acl_tmp;
+    unsigned long sector;
+    unsigned char *buf;
+    struct page *page;
+
+    snap_free_all();
+    /* Only pages whose write back failed are left */
+    xa_for_each(&mmap_pages, sector, page)
+        put_page(page);
+    xa_destroy(&mmap_pages);
+    xa_for_each(&store.sectors, sector, buf)
+        store_entry_free(buf, csum_clen(xa_load(&store.csums, sector)));
+    xa_for_each(&store.csums, sector, buf)
+        csum_free(buf);
+    xa_destroy(&store.sectors);
+    xa_destroy(&store.csums);
+    list_for_each_entry_safe(acl, acl_tmp, &sector_acls, list)
+        kfree(acl);
+    INIT_LIST_HEAD(&sector_acls);
+    kfree(stripe_scratch);
+    dedup_exit();
+    comp_exit();
+    kmem_cache_destroy(sector_cache);
+    kvfree(scrub_suspect_bits);
+    kvfree(sector_lock_bits);
+}
+
+/* Store, mirror replication, the scrubber and /sys/kernel/storage_device */
+static int storage_setup(void)
+{
+    int ret;
+
+    ret = store_init();
+    if (ret)
+        return ret;
+
+    ret = mirror_repl_init();
+    if (ret)
+        goto err_store;
+
+    /*
+     * Loads the image or replays the journal into the store and marks what
+     * it restored for the mirror
+     */
+    ret = journal_init();
+    if (ret)
+        goto err_journal;
+
+    ret = scrub_start();
+    if (ret)
+        goto err_journal;
+
+    storage_kobj = kobject_create_and_add("storage_device", kernel_kobj);
+    if (!storage_kobj)
+    {
+        ret = -ENOMEM;
+        goto err_scrub;
+    }
+    ret = sysfs_create_group(storage_kobj, &storage_attr_group);
+    if (ret)
+        goto err_kobj;
+    return 0;
+
+err_kobj:
+    kobject_put(storage_kobj);
+err_scrub:
+    scrub_stop();
+err_journal:
+    journal_exit();
+    mirror_repl_exit();
+err_store:
+    store_free();
+    return ret;
+}
+
+static void storage_teardown(void)
+{
+    kobject_put(storage_kobj);
+    scrub_stop();
+    journal_exit();
+    mirror_repl_exit();
+    store_free();
+}
+
+/* Any locked sector in first..last? */
+bool storage_range_locked(sector_t first, sector_t last)
+{
+    return find_next_bit(sector_lock_bits, last + 1, first) <= last;
+}
+EXPORT_SYMBOL(storage_range_locked);
+
+/*
+ * Lock or unlock sectors first..last. Locking writes back mapped pages
+ * first, so the next write through a mapping has to pass page_mkwrite.
+ */
+static int storage_set_locked(sector_t first, sector_t last, bool locked)
+{
+    int ret = 0;
+
+    storage_lock_range(first, last, true);
+    if (locked)
+        ret = mmap_writeback_range(first, last);
+    if (ret)
+    {
+        storage_unlock_range(first, last, true);
+        return ret;
+    }
+    spin_lock(&lock_bits_lock);
+    if (locked)
+        bitmap_set(sector_lock_bits, first, last - first + 1);
+    else
+        bitmap_clear(sector_lock_bits, first, last - first + 1);
+    spin_unlock(&lock_bits_lock);
+    storage_unlock_range(first, last, true);
+    return 0;
+}
+
+/* Validate a user range and turn it into first..last */
+static int storage_check_range(const struct storage_range *range, sector_t *first, sector_t *last)
+{
+    if (!range->count || range->first >= store.nr_sectors ||
+        range->count > store.nr_sectors - range->first)
+        return -EINVAL;
+    *first = range->first;
+    *last = range->first + range->count - 1;
+    return 0;
+}
 
-/* Device globals */
-static struct class *storage_class;
-static struct device *storage_device;
-static dev_t storage_dev_number;
-static struct cdev storage_cdev;
+/*
+ * Unlock keys. user_keys are hashed into key_table at load, so checking a
+ * key is one bucket walk however many there are. A sector may be in a
+ * range of sector_acls, the mask of user_keys indexes allowed to unlock
+ * it; one without takes any key.
+ */
+#define KEY_HASH_BITS 4
+
+struct storage_key
+{
+    struct hlist_node node;
+    unsigned int id;	/* index in user_keys */
+    const char *name;
+};
+
+static DEFINE_HASHTABLE(key_table, KEY_HASH_BITS);
+static struct storage_key key_slots[ARRAY_SIZE(user_keys)];
+
+static u32 key_hash(const char *key)
+{
+    return crc32c(0, key, strlen(key));
+}
+
+static int keys_init(void)
+{
+    int i;
+
+    for (i = 0; i < key_count; i++)
+    {
+        if (!*user_keys[i] || strlen(user_keys[i]) >= STORAGE_KEY_LEN)
+        {
+            pr_err("storageDevice: user key %d must be 1-%d characters\n", i, STORAGE_KEY_LEN - 1);
+            return -EINVAL;
+        }
+        key_slots[i].id = i;
+        key_slots[i].name = user_keys[i];
+        hash_add(key_table, &key_slots[i].node, key_hash(user_keys[i]));
+    }
+    return 0;
+}
+
+/* Index in user_keys of a key from user space, -EPERM if there is none */
+static int storage_key_find(const char *key)
+{
+    struct storage_key *k;
+
+    if (strnlen(key, STORAGE_KEY_LEN) == STORAGE_KEY_LEN)
+        return -EINVAL;
+    hash_for_each_possible(key_table, k, node, key_hash(key))
+    {
+        if (!strcmp(k->name, key))
+            return k->id;
+    }
+    return -EPERM;
+}
+
+/* May key id unlock all of first..last? acl_mutex held */
+static bool storage_acl_allows(sector_t first, sector_t last, int id)
+{
+    struct storage_acl *acl;
+
+    list_for_each_entry(acl, &sector_acls, list)
+    {
+        if (acl->first > last)
+            break;
+        if (acl->last >= first && !(acl->keys & BIT_ULL(id)))
+            return false;
+    }
+    return true;
+}
+
+/* Unlock first..last if key id may, -EPERM if not */
+static int storage_unlock_with_key(sector_t first, sector_t last, int id)
+{
+    int ret = -EPERM;
+
+    mutex_lock(&acl_mutex);
+    if (storage_acl_allows(first, last, id))
+        ret = storage_set_locked(first, last, false);
+    mutex_unlock(&acl_mutex);
+    return ret;
+}
+
+/*
+ * Limit first..last to the keys in mask, or lift their ACL with 0. The
+ * new range and the rest of one it may split are allocated first, so the
+ * list is either changed whole or, on -ENOMEM, not at all.
+ */
+static int storage_set_acl(sector_t first, sector_t last, u64 keys)
+{
+    struct storage_acl *acl, *tmp, *new = NULL, *split;
+
+    if (keys >> key_count)
+        return -EINVAL;
+    if (keys)
+    {
+        new = kmalloc(sizeof(*new), GFP_KERNEL);
+        if (!new)
+            return -ENOMEM;
+        new->first = first;
+        new->last = last;
+        new->keys = keys;
+    }
+    split = kmalloc(sizeof(*split), GFP_KERNEL);
+    if (!split)
+    {
+        kfree(new);
+        return -ENOMEM;
+    }
+
+    mutex_lock(&acl_mutex);
+    /* Cut first..last out of the ranges it overlaps */
+    list_for_each_entry_safe(acl, tmp, &sector_acls, list)
+    {
+        if (acl->last < first)
+            continue;
+        if (acl->first > last)
+            break;
+        if (acl->first < first && acl->last > last)
+        {
+            split->first = last + 1;
+            split->last = acl->last;
+            split->keys = acl->keys;
+            list_add(&split->list, &acl->list);
+            split = NULL;
+            acl->last = first - 1;
+            break;
+        }
+        if (acl->first < first)
+            acl->last = first - 1;
+        else if (acl->last > last)
+        {
+            acl->first = last + 1;
+            break;
+        }
+        else
+        {
+            list_del(&acl->list);
+            kfree(acl);
+        }
+    }
+    if (new)
+    {
+        list_for_each_entry(acl, &sector_acls, list)
+        {
+            if (acl->first > last)
+                break;
+        }
+        list_add_tail(&new->list, &acl->list);
+    }
+    mutex_unlock(&acl_mutex);
+    kfree(split);
+    return 0;
+}
+
+/*
+ * IOCTL_UNLOCK_RANGES: check every range and the key against each before
+ * unlocking any of them, all under acl_mutex.
+ */
+static int storage_unlock_ranges(const struct storage_unlock_ranges *req)
+{
+    struct storage_range *ranges;
+    sector_t first, last;
+    unsigned int i;
+    int id, ret = 0;
+
+    if (!req->nr || req->nr > STORAGE_UNLOCK_MAX_RANGES)
+        return -EINVAL;
+    id = storage_key_find(req->key);
+    if (id < 0)
+        return id;
+    ranges = vmemdup_user(u64_to_user_ptr(req->ranges), array_size(req->nr, sizeof(*ranges)));
+    if (IS_ERR(ranges))
+        return PTR_ERR(ranges);
+
+    mutex_lock(&acl_mutex);
+    for (i = 0; i < req->nr && !ret; i++)
+    {
+        ret = storage_check_range(&ranges[i], &first, &last);
+        if (!ret && !storage_acl_allows(first, last, id))
+            ret = -EPERM;
+    }
+    for (i = 0; i < req->nr && !ret; i++)
+    {
+        storage_check_range(&ranges[i], &first, &last);
+        storage_set_locked(first, last, false);
+    }
+    mutex_unlock(&acl_mutex);
+    kvfree(ranges);
+    if (!ret)
+        pr_info("storageDevice: %u ranges unlocked with key %d\n", req->nr, id);
+    return ret;
+}
+
+/*
+ * Copy the lock bits of a range out as packed bytes, a chunk at a time.
+ * Only set bits are visited, so a mostly unlocked range is cheap.
+ */
+static int storage_copy_lock_bitmap(const struct storage_lock_bitmap *req)
+{
+    u8 __user *ubits = u64_to_user_ptr(req->bits);
+    sector_t first, last, base;
+    u8 *chunk;
+    int ret;
+
+    ret = storage_check_range(&req->range, &first, &last);
+    if (ret)
+        return ret;
+
+    chunk = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (!chunk)
+        return -ENOMEM;
+
+    for (base = first; base <= last; base += PAGE_SIZE * 8)
+    {
+        sector_t end = min_t(sector_t, last + 1, base + PAGE_SIZE * 8);
+        size_t bytes = DIV_ROUND_UP(end - base, 8);
+        unsigned long bit;
 
-/* Backing storage and metadata */
-static unsigned char storage_buffer[STORAGE_TOTAL_SIZE];
-static bool sector_lock_state[STORAGE_NUM_SECTORS];
-static DEFINE_MUTEX(storage_mutex);
+        memset(chunk, 0, bytes);
+        for (bit = find_next_bit(sector_lock_bits, end, base); bit < end;
+             bit = find_next_bit(sector_lock_bits, end, bit + 1))
+            chunk[(bit - base) / 8] |= 1 << ((bit - base) % 8);
 
-/* File operations */
-static ssize_t storage_read(struct file *file, 
-							char __user *user_buffer,
-                            size_t length, 
-							loff_t *offset)
+        if (copy_to_user(ubits + (base - first) / 8, chunk, bytes))
+        {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    kfree(chunk);
+    return ret;
+}
+
+/*
+ * File operations. read_iter/write_iter take the stripe locks once for the
+ * whole request and walk the segments of the iov_iter under them, so a
+ * readv()/writev()/preadv2() or io_uring request with many segments costs
+ * one lock round trip, and plain read()/write() come through here too.
+ */
+
+/* Read the live store (snap NULL) or a snapshot */
+static ssize_t store_read_iter(struct storage_snapshot *snap, struct kiocb *iocb, struct iov_iter *to)
 {
-    if (*offset >= STORAGE_TOTAL_SIZE)
+    loff_t pos = iocb->ki_pos;
+    size_t length = iov_iter_count(to);
+    unsigned char *scratch = NULL;
+    sector_t first, last;
+    ssize_t ret = 0;
+    size_t done = 0;
+    bool fault;
+
+    if (pos >= store.size)
+        return 0;
+
+    if (length > store.size - pos)
+        length = store.size - pos;
+    if (!length)
         return 0;
 
-    if (*offset + length > STORAGE_TOTAL_SIZE)
-        length = STORAGE_TOTAL_SIZE - *offset;
+    /* Compressed sectors are decompressed here on their way out */
+    if (store_mode == STORE_COMPRESSED)
+    {
+        scratch = kmalloc(STORAGE_SECTOR_SIZE, GFP_KERNEL);
+        if (!scratch)
+            return -ENOMEM;
+    }
 
-    if (mutex_lock_interruptible(&storage_mutex))
-        return -ERESTARTSYS;
+    last = (pos + length - 1) >> STORAGE_SECTOR_SHIFT;
+again:
+    fault = false;
+    first = pos >> STORAGE_SECTOR_SHIFT;
+    storage_lock_range(first, last, false);
 
-    if (copy_to_user(user_buffer, storage_buffer + *offset, length)) 
-	{
-        mutex_unlock(&storage_mutex);
-        return -EFAULT;
+    while (done < length)
+    {
+        size_t off = pos & (STORAGE_SECTOR_SIZE - 1);
+        size_t chunk = min_t(size_t, length - done, STORAGE_SECTOR_SIZE - off);
+        sector_t sector = pos >> STORAGE_SECTOR_SHIFT;
+        const unsigned char *buf;
+        size_t copied;
+
+        if (snap)
+            buf = snap_lookup(snap, sector, scratch);
+        else if (store_read_sector(sector, scratch, &buf))
+        {
+            if (!done)
+                ret = -EIO;
+            break;
+        }
+
+        /* The destination may be a mapping of the store, see mmap_pages */
+        pagefault_disable();
+        /* Unwritten sectors are zero-filled without touching any store memory */
+        if (buf)
+            copied = copy_to_iter(buf + off, chunk, to);
+        else
+            copied = iov_iter_zero(chunk, to);
+        pagefault_enable();
+        done += copied;
+        pos += copied;
+        if (copied != chunk)
+        {
+            fault = true;
+            break;
+        }
+    }
+
+    storage_unlock_range(first, last, false);
+    if (fault)
+    {
+        /* Fault the rest of the buffer in with no stripe held and go again */
+        if (fault_in_iov_iter_writeable(to, length - done) != length - done)
+            goto again;
+        if (!done)
+            ret = -EFAULT;
     }
+    kfree(scratch);
+    if (ret)
+        return ret;
+    iocb->ki_pos = pos;
+    return done;
+}
 
-    *offset += length;
-    mutex_unlock(&storage_mutex);
-    return length;
+static ssize_t storage_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    return store_read_iter(NULL, iocb, to);
 }
 
-static ssize_t storage_write(struct file *file, 
-							const char __user *user_buffer,
-							size_t length, 
-							loff_t *offset)
+static ssize_t storage_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    if (*offset >= STORAGE_TOTAL_SIZE)
+    loff_t pos = iocb->ki_pos, start;
+    size_t length = iov_iter_count(from);
+    sector_t sector_start, sector_end;
+    struct journal_entry *je = NULL;
+    ssize_t ret = 0;
+    size_t done = 0;
+    u64 seq = 0;
+    bool fault;
+
+    if (pos >= store.size)
         return -ENOSPC;
 
-    if (*offset + length > STORAGE_TOTAL_SIZE)
-        length = STORAGE_TOTAL_SIZE - *offset;
+    if (length > store.size - pos)
+        length = store.size - pos;
+    if (!length)
+        return 0;
+
+    /* Journaled writes are one change only if they don't fault midway */
+    if (journal_filp)
+        fault_in_iov_iter_readable(from, length);
+
+    sector_end = (pos + length - 1) >> STORAGE_SECTOR_SHIFT;
+again:
+    fault = false;
+    start = pos;
+    sector_start = pos >> STORAGE_SECTOR_SHIFT;
+    storage_lock_range(sector_start, sector_end, true);
 
     /* Check sector locks */
+	if (storage_range_locked(sector_start, sector_end))
+		ret = -EPERM; /* sector locked */
+	else
+		ret = mmap_writeback_range(sector_start, sector_end);
+	if (!ret)
 	{
-		size_t start = (size_t)*offset;
-		size_t end = start + length;
-		int sector_start = start / STORAGE_SECTOR_SIZE;
-		int sector_end = (end - 1) / STORAGE_SECTOR_SIZE;
+		je = journal_alloc(sector_end - sector_start + 1);
+		if (IS_ERR(je))
+		{
+			ret = PTR_ERR(je);
+			je = NULL;
+		}
+	}
 
-		if (mutex_lock_interruptible(&storage_mutex))
-			return -ERESTARTSYS;
+	while (!ret && done < length)
+	{
+		size_t off = pos & (STORAGE_SECTOR_SIZE - 1);
+		size_t chunk = min_t(size_t, length - done, STORAGE_SECTOR_SIZE - off);
+		unsigned char *buf = store_get_cow(pos >> STORAGE_SECTOR_SHIFT);
+		size_t copied;
 
+		if (!buf)
 		{
-			int s;
-			for (s = sector_start; s <= sector_end; s++) 
-			{
-				if (sector_lock_state[s]) 
-				{
-					mutex_unlock(&storage_mutex);
-					return -EPERM; /* sector locked */
-				}
-			}
+			if (!done)
+				ret = -ENOMEM;
+			break;
 		}
-
-		if (copy_from_user(storage_buffer + *offset, user_buffer, length)) 
+		/* The source may be a mapping of the store, see mmap_pages */
+		pagefault_disable();
+		copied = copy_from_iter(buf + off, chunk, from);
+		pagefault_enable();
+		if (store_put(pos >> STORAGE_SECTOR_SHIFT, buf))
+		{
+			if (!done)
+				ret = -ENOMEM;
+			break;
+		}
+		done += copied;
+		pos += copied;
+		if (copied != chunk)
 		{
-			mutex_unlock(&storage_mutex);
-			return -EFAULT;
+			fault = true;
+			break;
 		}
 	}
 
-	*offset += length;
-	mutex_unlock(&storage_mutex);
-	return length;
+	if (pos > start)
+	{
+		storage_mark_dirty(sector_start, (pos - 1) >> STORAGE_SECTOR_SHIFT);
+		mmap_invalidate_range(sector_start, (pos - 1) >> STORAGE_SECTOR_SHIFT);
+		seq = journal_log(je, sector_start, (pos - 1) >> STORAGE_SECTOR_SHIFT, 0);
+	}
+	else
+		journal_discard(je);
+	je = NULL;
+	storage_unlock_range(sector_start, sector_end, true);
+	if (fault)
+	{
+		/* Fault the rest of the source in with no stripe held and go again */
+		if (fault_in_iov_iter_readable(from, length - done) != length - done)
+			goto again;
+		if (!done)
+			ret = -EFAULT;
+	}
+	if (!done)
+		return ret;
+	iocb->ki_pos = pos;
+	/* O_SYNC/O_DSYNC: wait for the group commit carrying the write */
+	if (iocb->ki_flags & IOCB_DSYNC)
+	{
+		ret = journal_sync(seq);
+		if (ret)
+			return ret;
+	}
+	return done;
+}
+
+/* fsync(): with a journal, everything written so far is on disk */
+static int storage_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    return storage_flush();
+}
+
+/*
+ * Take a mapped page's stripe in a fault handler. A stripe holder may be
+ * faulting on user memory itself, so never sleep on the stripe with
+ * mmap_lock held: drop mmap_lock, wait, and have the fault retried.
+ */
+static vm_fault_t mmap_lock_stripe(struct vm_fault *vmf, struct rw_semaphore *sem)
+{
+    if (down_read_trylock(sem))
+        return 0;
+    if (fault_flag_allow_retry_first(vmf->flags))
+    {
+        if (!(vmf->flags & FAULT_FLAG_RETRY_NOWAIT))
+        {
+            mmap_read_unlock(vmf->vma->vm_mm);
+            down_read(sem);
+            up_read(sem);
+        }
+        return VM_FAULT_RETRY;
+    }
+    /* Can't drop mmap_lock here, let the access fault again */
+    return VM_FAULT_NOPAGE;
+}
+
+/* Map a page of the store, assembling it from its sectors if needed */
+static vm_fault_t storage_vm_fault(struct vm_fault *vmf)
+{
+    pgoff_t index = vmf->pgoff;
+    loff_t pos = (loff_t)index << PAGE_SHIFT;
+    struct rw_semaphore *sem;
+    struct page *page, *old;
+    vm_fault_t ret;
+
+    if (pos >= store.size)
+        return VM_FAULT_SIGBUS;
+    sem = &stripe_locks[stripe_of(pos >> STORAGE_SECTOR_SHIFT)];
+    ret = mmap_lock_stripe(vmf, sem);
+    if (ret)
+        return ret;
+
+    page = xa_load(&mmap_pages, index);
+    if (!page)
+    {
+        page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+        if (!page)
+        {
+            ret = VM_FAULT_OOM;
+            goto out;
+        }
+        /* A sector failing its checksum can't be mapped */
+        if (storage_copy_out(pos, page_address(page), min_t(loff_t, PAGE_SIZE, store.size - pos)))
+        {
+            __free_page(page);
+            ret = VM_FAULT_SIGBUS;
+            goto out;
+        }
+        /* Faults on the page only hold the stripe for read */
+        old = xa_cmpxchg(&mmap_pages, index, NULL, page, GFP_KERNEL);
+        if (old)
+        {
+            __free_page(page);
+            if (xa_is_err(old))
+            {
+                ret = VM_FAULT_OOM;
+                goto out;
+            }
+            page = old;
+        }
+    }
+    get_page(page);
+    up_read(sem);
+
+    /*
+     * The page is mapped only after the stripe is gone: lock it so that
+     * mmap_drop_page() waits for the mapping and unmaps it again, and
+     * fault once more if it was dropped in between
+     */
+    lock_page(page);
+    if (xa_load(&mmap_pages, index) != page)
+    {
+        unlock_page(page);
+        put_page(page);
+        return VM_FAULT_NOPAGE;
+    }
+    vmf->page = page;
+    return VM_FAULT_LOCKED;
+out:
+    up_read(sem);
+    return ret;
+}
+
+/* First write to a mapped page: refused if any of its sectors is locked */
+static vm_fault_t storage_vm_page_mkwrite(struct vm_fault *vmf)
+{
+    pgoff_t index = vmf->pgoff;
+    sector_t first = (sector_t)index * STORAGE_STRIPE_SECTORS;
+    sector_t last = min_t(sector_t, first + STORAGE_STRIPE_SECTORS, store.nr_sectors) - 1;
+    struct rw_semaphore *sem = &stripe_locks[stripe_of(first)];
+    vm_fault_t ret;
+
+    ret = mmap_lock_stripe(vmf, sem);
+    if (ret)
+        return ret;
+
+    if (xa_load(&mmap_pages, index) != vmf->page)
+        ret = VM_FAULT_NOPAGE;	/* written back meanwhile, fault it in again */
+    else if (storage_range_locked(first, last))
+        ret = VM_FAULT_SIGBUS;
+    else
+    {
+        xa_set_mark(&mmap_pages, index, MMAP_PAGE_DIRTY);
+        lock_page(vmf->page);
+        ret = VM_FAULT_LOCKED;
+    }
+    up_read(sem);
+    return ret;
+}
+
+static void storage_vm_open(struct vm_area_struct *vma)
+{
+    atomic_inc(&mmap_count);
+}
+
+/* Runs with mmap_lock held, so write back is left to release */
+static void storage_vm_close(struct vm_area_struct *vma)
+{
+    atomic_dec(&mmap_count);
+}
+
+static const struct vm_operations_struct storage_vm_ops = {
+    .open = storage_vm_open,
+    .close = storage_vm_close,
+    .fault = storage_vm_fault,
+    .page_mkwrite = storage_vm_page_mkwrite,
+};
+
+/*
+ * Shared mappings write through to the store as described above; private
+ * ones get copies of the pages. All mappings go through one device node.
+ */
+static int storage_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    int ret = 0;
+
+    if (vma->vm_pgoff + vma_pages(vma) > DIV_ROUND_UP(store.size, PAGE_SIZE))
+        return -EINVAL;
+
+    mutex_lock(&mmap_mutex);
+    if (atomic_read(&mmap_count) && mmap_mapping != file->f_mapping)
+        ret = -EBUSY; /* mapped through another device node */
+    else
+    {
+        mmap_mapping = file->f_mapping;
+        vma->vm_flags |= VM_DONTEXPAND;
+        vma->vm_ops = &storage_vm_ops;
+        atomic_inc(&mmap_count);
+    }
+    mutex_unlock(&mmap_mutex);
+    return ret;
+}
+
+/* Write back and free every mapped page once nothing maps the store */
+static void mmap_release(void)
+{
+    sector_t last = store.nr_sectors - 1;
+
+    if (atomic_read(&mmap_count) || xa_empty(&mmap_pages))
+        return;
+    storage_lock_range(0, last, true);
+    if (mmap_writeback_range(0, last))
+        pr_warn("storageDevice: mapped writes kept in memory, out of memory storing them\n");
+    mmap_invalidate_range(0, last);
+    storage_unlock_range(0, last, true);
 }
 
 static int storage_open(struct inode *inode, struct file *file)
@@ -119,6 +3157,7 @@ static int storage_open(struct inode *inode, struct file *file)
 
 static int storage_release(struct inode *inode, struct file *file)
 {
+    mmap_release();
     pr_info("storageDevice: released\n");
     return 0;
 }
@@ -131,67 +3170,52 @@ static long storage_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 	{
 		case IOCTL_LOCK_SECTOR:
 		{
+			int ret;
+
 			if (copy_from_user(&sector_index, (int __user *)arg, sizeof(int)))
 				return -EFAULT;
-			if (sector_index < 0 || sector_index >= STORAGE_NUM_SECTORS)
+			if (sector_index < 0 || sector_index >= store.nr_sectors)
 				return -EINVAL;
-			mutex_lock(&storage_mutex);
-			sector_lock_state[sector_index] = true;
-			mutex_unlock(&storage_mutex);
+			ret = storage_set_locked(sector_index, sector_index, true);
+			if (ret)
+				return ret;
 			pr_info("storageDevice: sector %d locked\n", sector_index);
 			return 0;
 		}
 
 		case IOCTL_UNLOCK_SECTOR:
 		{
-			struct {
-				int sector : 3;
-				char key;
-			} unlock_req;
+			struct storage_unlock unlock_req;
+			int id, ret;
 
 			if (copy_from_user(&unlock_req, (void __user *)arg, sizeof(unlock_req)))
 				return -EFAULT;
 
-			if (unlock_req.sector < 0 || unlock_req.sector >= STORAGE_NUM_SECTORS)
+			if (unlock_req.sector >= store.nr_sectors)
 				return -EINVAL;
 
-			/* Check key against module_param_array */
-			{
-				_Bool valid = false;
-				int i;
-				for (i = 0; i < key_count; i++) 
-				{
-					if (user_keys[i] && (unlock_req.key == *user_keys[i]))
-					{
-						valid = true;
-						break;
-					}
-				}
-				if (!valid)
-					return -EPERM; /* invalid key */
-			}
-			if (mutex_lock_interruptible(&storage_mutex))
-				return -ERESTARTSYS;
-
-			sector_lock_state[unlock_req.sector] = false;
-			mutex_unlock(&storage_mutex);
+			id = storage_key_find(unlock_req.key);
+			if (id < 0)
+				return id; /* invalid key */
+			ret = storage_unlock_with_key(unlock_req.sector, unlock_req.sector, id);
+			if (ret)
+				return ret;
 
-			pr_info("storageDevice: sector %d unlocked with key %d\n",
-					unlock_req.sector, unlock_req.key);
+			pr_info("storageDevice: sector %llu unlocked with key %d\n",
+					(unsigned long long)unlock_req.sector, id);
 			return 0;
 		}
 
 		case IOCTL_GET_LOCK_INFO:
 		{
 			int i;
-			bool lock_info[STORAGE_NUM_SECTORS];
-			mutex_lock(&storage_mutex);
-			
-			for (i = 0; i < STORAGE_NUM_SECTORS; i++)
-				lock_info[i] = sector_lock_state[i];
-			mutex_unlock(&storage_mutex);
+			__u8 lock_info[STORAGE_LOCK_INFO_SECTORS] = { 0 };
 
-			if (copy_to_user((bool __user *)arg, lock_info, sizeof(lock_info)))
+			/* A snapshot, no lock needed */
+			for (i = 0; i < STORAGE_LOCK_INFO_SECTORS && i < store.nr_sectors; i++)
+				lock_info[i] = test_bit(i, sector_lock_bits);
+
+			if (copy_to_user((void __user *)arg, lock_info, sizeof(lock_info)))
 				return -EFAULT;
 			return 0;
 		}
@@ -200,31 +3224,175 @@ static long storage_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 		{
 			if (copy_from_user(&sector_index, (int __user *)arg, sizeof(int)))
 				return -EFAULT;
-			if (sector_index < 0 || sector_index >= STORAGE_NUM_SECTORS)
+			if (sector_index < 0 || sector_index >= store.nr_sectors)
 				return -EINVAL;
-			mutex_lock(&storage_mutex);
-			if (sector_lock_state[sector_index]) 
+			storage_lock_range(sector_index, sector_index, true);
+			if (test_bit(sector_index, sector_lock_bits)) 
 			{
-				mutex_unlock(&storage_mutex);
+				storage_unlock_range(sector_index, sector_index, true);
 				return -EPERM; /* cannot erase locked sector */
 			}
-			memset(storage_buffer + (sector_index * STORAGE_SECTOR_SIZE), 0, STORAGE_SECTOR_SIZE);
-			mutex_unlock(&storage_mutex);
+			if (storage_erase_range(sector_index, sector_index))
+			{
+				storage_unlock_range(sector_index, sector_index, true);
+				return -ENOMEM;
+			}
+			storage_unlock_range(sector_index, sector_index, true);
 			pr_info("storageDevice: sector %d erased\n", sector_index);
 			return 0;
 		}
 			
+		case IOCTL_ERASE_RANGE:
+		{
+			struct storage_range range;
+			sector_t first, last;
+			int ret;
+
+			if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+				return -EFAULT;
+			ret = storage_check_range(&range, &first, &last);
+			if (ret)
+				return ret;
+
+			storage_lock_range(first, last, true);
+			if (storage_range_locked(first, last))
+				ret = -EPERM; /* cannot erase locked sectors */
+			else
+				ret = storage_erase_range(first, last);
+			storage_unlock_range(first, last, true);
+			if (!ret)
+				pr_info("storageDevice: sectors %llu-%llu erased\n",
+						(unsigned long long)first, (unsigned long long)last);
+			return ret;
+		}
+
 		case IOCTL_MIRROR_SECTOR:
 		{
 			int sector_index;
+			unsigned char *buf;
+			int ret;
+
 			if (copy_from_user(&sector_index, (int __user *)arg, sizeof(int)))
 				return -EFAULT;
-			if (sector_index < 0 || sector_index >= STORAGE_NUM_SECTORS)
+			if (sector_index < 0 || sector_index >= store.nr_sectors)
 				return -EINVAL;
+			buf = kmalloc(STORAGE_SECTOR_SIZE, GFP_KERNEL);
+			if (!buf)
+				return -ENOMEM;
+
+			/* Copy from the store into mirror_buffer */
+			storage_lock_range(sector_index, sector_index, false);
+			ret = storage_copy_out((loff_t)sector_index << STORAGE_SECTOR_SHIFT, buf, STORAGE_SECTOR_SIZE);
+			if (!ret)
+				mirror_sector(sector_index, buf);
+			storage_unlock_range(sector_index, sector_index, false);
+			kfree(buf);
+			return ret;
+		}
+
+		case IOCTL_LOCK_RANGE:
+		{
+			struct storage_range range;
+			sector_t first, last;
+			int ret;
+
+			if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+				return -EFAULT;
+			ret = storage_check_range(&range, &first, &last);
+			if (ret)
+				return ret;
+			ret = storage_set_locked(first, last, true);
+			if (ret)
+				return ret;
+			pr_info("storageDevice: sectors %llu-%llu locked\n",
+					(unsigned long long)first, (unsigned long long)last);
+			return 0;
+		}
+
+		case IOCTL_UNLOCK_RANGE:
+		{
+			struct storage_range_unlock req;
+			sector_t first, last;
+			int id, ret;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+				return -EFAULT;
+			ret = storage_check_range(&req.range, &first, &last);
+			if (ret)
+				return ret;
+			id = storage_key_find(req.key);
+			if (id < 0)
+				return id; /* invalid key */
+			ret = storage_unlock_with_key(first, last, id);
+			if (ret)
+				return ret;
+			pr_info("storageDevice: sectors %llu-%llu unlocked with key %d\n",
+					(unsigned long long)first, (unsigned long long)last, id);
+			return 0;
+		}
+
+		case IOCTL_UNLOCK_RANGES:
+		{
+			struct storage_unlock_ranges req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+				return -EFAULT;
+			return storage_unlock_ranges(&req);
+		}
+
+		case IOCTL_SET_SECTOR_KEYS:
+		{
+			struct storage_key_acl req;
+			sector_t first, last;
+			int ret;
+
+			if (!capable(CAP_SYS_ADMIN))
+				return -EPERM;
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+				return -EFAULT;
+			ret = storage_check_range(&req.range, &first, &last);
+			if (ret)
+				return ret;
+			ret = storage_set_acl(first, last, req.keys);
+			if (ret)
+				return ret;
+			pr_info("storageDevice: sectors %llu-%llu take keys %#llx\n",
+					(unsigned long long)first, (unsigned long long)last, req.keys);
+			return 0;
+		}
+
+		case IOCTL_GET_LOCK_BITMAP:
+		{
+			struct storage_lock_bitmap req;
+
+			if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+				return -EFAULT;
+			return storage_copy_lock_bitmap(&req);
+		}
+
+		case IOCTL_MIRROR_SYNC:
+			mirror_sync();
+			return 0;
+
+		case IOCTL_MMAP_SYNC:
+		{
+			struct storage_range range;
+			sector_t first, last;
+			int ret;
+
+			if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+				return -EFAULT;
+			ret = storage_check_range(&range, &first, &last);
+			if (ret)
+				return ret;
 
-			/* Copy from storage_buffer into mirror_buffer */
-			mirror_sector(sector_index,
-						  storage_buffer + (sector_index * STORAGE_SECTOR_SIZE));
+			/* Like msync(): store what was written through mappings, then mirror it */
+			storage_lock_range(first, last, true);
+			ret = mmap_writeback_range(first, last);
+			storage_unlock_range(first, last, true);
+			if (ret)
+				return ret;
+			mirror_sync();
 			return 0;
 		}
 
@@ -237,6 +3405,33 @@ static long storage_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 			return vblock_backup_to_file(path);
 		}
 
+		case IOCTL_BACKUP_DELTA:
+		{
+			char path[256];
+			long len = strncpy_from_user(path, (char __user *)arg, sizeof(path));
+
+			/* As getname(): empty and unterminated paths are refused */
+			if (len < 0)
+				return len;
+			if (!len)
+				return -EINVAL;
+			if (len == sizeof(path))
+				return -ENAMETOOLONG;
+
+			return vblock_backup_delta(path);
+		}
+
+		case IOCTL_SNAP_CREATE:
+		case IOCTL_SNAP_DELETE:
+		{
+			char name[STORAGE_SNAP_NAME_LEN];
+			if (copy_from_user(name, (char __user *)arg, sizeof(name)))
+				return -EFAULT;
+			name[sizeof(name) - 1] = '\0';
+
+			return cmd == IOCTL_SNAP_CREATE ? snap_create(name) : snap_delete(name);
+		}
+
 		default:
 			return -ENOTTY;
     }
@@ -244,11 +3439,86 @@ static long storage_ioctl(struct file *file, unsigned int cmd, unsigned long arg
 
 static const struct file_operations storage_fops = {
     .owner          = THIS_MODULE,
-    .read           = storage_read,
-    .write          = storage_write,
+    .read_iter      = storage_read_iter,
+    .write_iter     = storage_write_iter,
     .open           = storage_open,
     .release        = storage_release,
     .unlocked_ioctl = storage_ioctl,
+    .mmap           = storage_mmap,
+    .fsync          = storage_fsync,
+    .llseek         = default_llseek,
+};
+
+/*
+ * /dev/storageSnap: read-only view of one snapshot. The file pins its
+ * snapshot against IOCTL_SNAP_DELETE until it is closed or switched.
+ */
+static ssize_t snap_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    return store_read_iter(iocb->ki_filp->private_data, iocb, to);
+}
+
+static int snap_open(struct inode *inode, struct file *file)
+{
+    struct storage_snapshot *snap;
+
+    if (file->f_mode & FMODE_WRITE)
+        return -EROFS;
+
+    mutex_lock(&snap_mutex);
+    if (list_empty(&snapshots))
+    {
+        mutex_unlock(&snap_mutex);
+        return -ENOENT;
+    }
+    snap = list_last_entry(&snapshots, struct storage_snapshot, list);
+    snap->users++;
+    file->private_data = snap;
+    mutex_unlock(&snap_mutex);
+    return 0;
+}
+
+static int snap_release(struct inode *inode, struct file *file)
+{
+    struct storage_snapshot *snap = file->private_data;
+
+    mutex_lock(&snap_mutex);
+    snap->users--;
+    mutex_unlock(&snap_mutex);
+    return 0;
+}
+
+static long snap_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct storage_snapshot *snap, *prev = file->private_data;
+    char name[STORAGE_SNAP_NAME_LEN];
+
+    if (cmd != IOCTL_SNAP_SELECT)
+        return -ENOTTY;
+    if (copy_from_user(name, (char __user *)arg, sizeof(name)))
+        return -EFAULT;
+    name[sizeof(name) - 1] = '\0';
+
+    mutex_lock(&snap_mutex);
+    snap = snap_find(name);
+    if (!snap)
+    {
+        mutex_unlock(&snap_mutex);
+        return -ENOENT;
+    }
+    prev->users--;
+    snap->users++;
+    file->private_data = snap;
+    mutex_unlock(&snap_mutex);
+    return 0;
+}
+
+static const struct file_operations snap_fops = {
+    .owner          = THIS_MODULE,
+    .read_iter      = snap_read_iter,
+    .open           = snap_open,
+    .release        = snap_release,
+    .unlocked_ioctl = snap_ioctl,
     .llseek         = default_llseek,
 };
 
@@ -265,21 +3535,27 @@ static int __init storage_driver_init(void)
             user_keys[i] = default_keys[i];
         }
         key_count = 8;
-        pr_info("storageDevice: using default keys A–H\n");
+        pr_info("storageDevice: using default keys A-H\n");
     } 
 	else 
 	{
         pr_info("storageDevice: %d user keys provided\n", key_count);
     }
 
-    memset(storage_buffer, 0, sizeof(storage_buffer));
-    memset(sector_lock_state, 0, sizeof(sector_lock_state));
+    ret = keys_init();
+    if (ret)
+        return ret;
+
+    ret = storage_setup();
+    if (ret)
+        return ret;
 
-    ret = alloc_chrdev_region(&storage_dev_number, 0, 1, "storageDevice");
+    /* Minor 0 is the device itself, minor 1 its snapshots */
+    ret = alloc_chrdev_region(&storage_dev_number, 0, 2, "storageDevice");
     if (ret) 
 	{
         pr_err("storageDevice: alloc_chrdev_region failed\n");
-        return ret;
+        goto err_setup;
     }
 
     cdev_init(&storage_cdev, &storage_fops);
@@ -289,40 +3565,70 @@ static int __init storage_driver_init(void)
     if (ret) 
 	{
         pr_err("storageDevice: cdev_add failed\n");
-        unregister_chrdev_region(storage_dev_number, 1);
-        return ret;
+        goto err_region;
+    }
+
+    cdev_init(&snap_cdev, &snap_fops);
+    snap_cdev.owner = THIS_MODULE;
+
+    ret = cdev_add(&snap_cdev, storage_dev_number + 1, 1);
+    if (ret)
+    {
+        pr_err("storageDevice: cdev_add failed\n");
+        goto err_cdev;
     }
 
     storage_class = class_create(THIS_MODULE, "storage_class");
     if (IS_ERR(storage_class)) 
 	{
         ret = PTR_ERR(storage_class);
-        cdev_del(&storage_cdev);
-        unregister_chrdev_region(storage_dev_number, 1);
-        return ret;
+        goto err_snap_cdev;
     }
 
     storage_device = device_create(storage_class, NULL, storage_dev_number, NULL, "storageDevice");
     if (IS_ERR(storage_device)) 
 	{
         ret = PTR_ERR(storage_device);
-        class_destroy(storage_class);
-        cdev_del(&storage_cdev);
-        unregister_chrdev_region(storage_dev_number, 1);
-        return ret;
+        goto err_class;
+    }
+
+    snap_device = device_create(storage_class, NULL, storage_dev_number + 1, NULL, "storageSnap");
+    if (IS_ERR(snap_device))
+    {
+        ret = PTR_ERR(snap_device);
+        goto err_device;
     }
 
-    pr_info("storageDevice: driver initialized (major=%d minor=%d)\n", MAJOR(storage_dev_number), MINOR(storage_dev_number));
+    pr_info("storageDevice: driver initialized (major=%d minor=%d, %llu sectors)\n",
+            MAJOR(storage_dev_number), MINOR(storage_dev_number), (unsigned long long)store.nr_sectors);
     return 0;
+
+err_device:
+    device_destroy(storage_class, storage_dev_number);
+err_class:
+    class_destroy(storage_class);
+err_snap_cdev:
+    cdev_del(&snap_cdev);
+err_cdev:
+    cdev_del(&storage_cdev);
+err_region:
+    unregister_chrdev_region(storage_dev_number, 2);
+err_setup:
+    storage_teardown();
+    return ret;
 }
 
 static void __exit storage_driver_exit(void)
 {
+    device_destroy(storage_class, storage_dev_number + 1);
     device_destroy(storage_class, storage_dev_number);
     class_destroy(storage_class);
+    cdev_del(&snap_cdev);
     cdev_del(&storage_cdev);
-    unregister_chrdev_region(storage_dev_number, 1);
-    pr_info("storageDevice: driver unloaded\n");
+    unregister_chrdev_region(storage_dev_number, 2);
+    pr_info("storageDevice: driver unloaded (%ld sectors allocated)\n",
+            atomic_long_read(&store.nr_allocated));
+    storage_teardown();
 }
 
 module_init(storage_driver_init);
@@ -330,4 +3636,4 @@ module_exit(storage_driver_exit);
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("SK AHMED");
-MODULE_DESCRIPTION("Sector-based 4KB storage driver with lock/unlock/erase support");
\ No newline at end of file
+MODULE_DESCRIPTION("Sector-based storage driver with a sparse backing store and lock/unlock/erase support");
\ No newline at end of file
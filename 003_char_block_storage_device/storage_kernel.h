@@ -0,0 +1,29 @@
+#ifndef _STORAGE_KERNEL_H
+#define _STORAGE_KERNEL_H
+
+#include <linux/types.h>
+
+struct iov_iter;
+
+#define STORAGE_SECTOR_SHIFT 9
+#define STORAGE_SECTOR_SIZE  (1 << STORAGE_SECTOR_SHIFT)
+
+/*
+ * Sector store of storage_kernel.c, exported for the other frontends.
+ * Callers hold storage_lock_range() over the sectors they copy in or out
+ * and check storage_range_locked() before writing. storage_copy_out()
+ * fails with -EIO on a sector that doesn't match its checksum.
+ * storage_copy_in_iter() journals all it copies as a single change.
+ * storage_flush() waits until every change so far is in the journal.
+ */
+sector_t storage_nr_sectors(void);
+void storage_lock_range(sector_t first, sector_t last, bool write);
+void storage_unlock_range(sector_t first, sector_t last, bool write);
+bool storage_range_locked(sector_t first, sector_t last);
+int storage_copy_out(loff_t pos, void *dst, size_t len);
+int storage_copy_in(loff_t pos, const void *src, size_t len);
+int storage_copy_in_iter(loff_t pos, struct iov_iter *from);
+int storage_erase_range(sector_t first, sector_t last);
+int storage_flush(void);
+
+#endif
@@ -7,88 +7,410 @@
 #include <linux/string.h>
 #include <linux/file.h>
 #include <linux/uaccess.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/xarray.h>
+#include <linux/bitmap.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include "storage_ioctl.h"
 
-#define MIRROR_TOTAL_SIZE   4096
 #define MIRROR_SECTOR_SIZE  512
-#define MIRROR_NUM_SECTORS  (MIRROR_TOTAL_SIZE / MIRROR_SECTOR_SIZE)
+#define MIRROR_CHUNK_SECTORS 256	/* sectors per kernel_write() in a backup */
 
-static unsigned char mirror_buffer[MIRROR_TOTAL_SIZE];
+/*
+ * Sparse like the primary store: sector number -> MIRROR_SECTOR_SIZE
+ * buffer, allocated when the sector is first mirrored. Missing sectors
+ * are zeros. storage_kernel.c sets the capacity when it loads.
+ */
+static struct xarray mirror_sectors;
+static sector_t mirror_nr_sectors;
+static struct kmem_cache *mirror_cache;
 static DEFINE_MUTEX(mirror_mutex);
 static struct semaphore mirror_read_sem;
 
+/*
+ * Sectors mirrored since the last backup, full or delta, under
+ * mirror_mutex. A backup clears the bits of each chunk as it copies it, so
+ * sectors mirrored while it runs are picked up by the next delta.
+ */
+static unsigned long *backup_bits;
+static DEFINE_MUTEX(backup_mutex);	/* one backup at a time */
+
+/* Progress of the running backup, or totals of the last one */
+static atomic64_t backup_bytes;
+static u64 backup_kbps;
+
+/* Called with mirror_mutex held */
+static int mirror_store_sector(sector_t sector, const unsigned char *data)
+{
+    unsigned char *buf = xa_load(&mirror_sectors, sector);
+
+    /* An erased sector reads back as zeros without a buffer */
+    if (!memchr_inv(data, 0, MIRROR_SECTOR_SIZE))
+    {
+        if (buf)
+        {
+            xa_erase(&mirror_sectors, sector);
+            kmem_cache_free(mirror_cache, buf);
+        }
+        __set_bit(sector, backup_bits);
+        return 0;
+    }
+
+    if (!buf)
+    {
+        buf = kmem_cache_alloc(mirror_cache, GFP_KERNEL);
+        if (!buf)
+            return -ENOMEM;
+        if (xa_err(xa_store(&mirror_sectors, sector, buf, GFP_KERNEL)))
+        {
+            kmem_cache_free(mirror_cache, buf);
+            return -ENOMEM;
+        }
+    }
+    memcpy(buf, data, MIRROR_SECTOR_SIZE);
+    __set_bit(sector, backup_bits);
+    return 0;
+}
+
+/* Called with mirror_mutex held: zeros for sectors never mirrored */
+static void mirror_read_sector(sector_t sector, unsigned char *data)
+{
+    unsigned char *buf = xa_load(&mirror_sectors, sector);
+
+    if (buf)
+        memcpy(data, buf, MIRROR_SECTOR_SIZE);
+    else
+        memset(data, 0, MIRROR_SECTOR_SIZE);
+}
+
+/*
+ * Exported: size the mirror to the primary store, dropping sectors past the
+ * end. Sectors kept are all due for the next delta backup.
+ */
+int mirror_set_capacity(sector_t nr_sectors)
+{
+    unsigned long *bits;
+    unsigned long sector;
+    unsigned char *buf;
+
+    bits = kvcalloc(BITS_TO_LONGS(nr_sectors), sizeof(long), GFP_KERNEL);
+    if (!bits)
+        return -ENOMEM;
+
+    mutex_lock(&mirror_mutex);
+    xa_for_each(&mirror_sectors, sector, buf)
+    {
+        if (sector < nr_sectors)
+        {
+            __set_bit(sector, bits);
+            continue;
+        }
+        xa_erase(&mirror_sectors, sector);
+        kmem_cache_free(mirror_cache, buf);
+    }
+    kvfree(backup_bits);
+    backup_bits = bits;
+    mirror_nr_sectors = nr_sectors;
+    mutex_unlock(&mirror_mutex);
+    return 0;
+}
+EXPORT_SYMBOL(mirror_set_capacity);
+
+/*
+ * Exported: copy n sectors into the mirror under a single lock hold. data
+ * holds the n sectors back to back, in the order of sectors[].
+ */
+int mirror_write_batch(const sector_t *sectors, const unsigned char *data, unsigned int n)
+{
+    unsigned int i;
+    int ret = 0;
+
+    mutex_lock(&mirror_mutex);
+    for (i = 0; i < n && !ret; i++)
+    {
+        if (sectors[i] < mirror_nr_sectors)
+            ret = mirror_store_sector(sectors[i], data + i * MIRROR_SECTOR_SIZE);
+    }
+    mutex_unlock(&mirror_mutex);
+    return ret;
+}
+EXPORT_SYMBOL(mirror_write_batch);
+
+/* Exported: copy one mirrored sector out, zeros if it was never mirrored */
+int mirror_fetch_sector(sector_t sector, unsigned char *data)
+{
+    int ret = 0;
+
+    mutex_lock(&mirror_mutex);
+    if (sector < mirror_nr_sectors)
+        mirror_read_sector(sector, data);
+    else
+        ret = -EINVAL;
+    mutex_unlock(&mirror_mutex);
+    return ret;
+}
+EXPORT_SYMBOL(mirror_fetch_sector);
+
 /* Exported: copy one sector into mirror */
 void mirror_sector(int sector, const unsigned char *data)
 {
-    if (sector < 0 || sector >= MIRROR_NUM_SECTORS)
-        return;
+    sector_t s = sector;
 
-    if (mutex_lock_interruptible(&mirror_mutex))
+    if (sector < 0 || s >= mirror_nr_sectors)
         return;
 
-    memcpy(mirror_buffer + (sector * MIRROR_SECTOR_SIZE),
-           data,
-           MIRROR_SECTOR_SIZE);
-
-    mutex_unlock(&mirror_mutex);
-    pr_info("storageMirror: sector %d mirrored\n", sector);
+    if (!mirror_write_batch(&s, data, 1))
+        pr_info("storageMirror: sector %d mirrored\n", sector);
 }
 EXPORT_SYMBOL(mirror_sector);
 
-/* Exported: dump full mirror buffer to a file */
-int vblock_backup_to_file(const char *path)
+/*
+ * Fill chunk with the next run of sectors of a full image, starting at
+ * *sector. Called with mirror_mutex held. Returns the bytes filled.
+ */
+static size_t backup_fill_full(unsigned char *chunk, sector_t *sector)
+{
+    unsigned int n = min_t(sector_t, MIRROR_CHUNK_SECTORS, mirror_nr_sectors - *sector);
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        mirror_read_sector(*sector + i, chunk + i * MIRROR_SECTOR_SIZE);
+    bitmap_clear(backup_bits, *sector, n);
+    *sector += n;
+    return (size_t)n * MIRROR_SECTOR_SIZE;
+}
+
+/*
+ * Fill chunk with up to MIRROR_CHUNK_SECTORS changed sectors from *sector
+ * on, as extents of contiguous runs. Called with mirror_mutex held.
+ */
+static size_t backup_fill_delta(unsigned char *chunk, sector_t *sector,
+                                struct storage_delta_header *hdr)
+{
+    unsigned long s = find_next_bit(backup_bits, mirror_nr_sectors, *sector);
+    unsigned int taken = 0;
+    size_t len = 0;
+
+    while (s < mirror_nr_sectors && taken < MIRROR_CHUNK_SECTORS)
+    {
+        struct storage_delta_extent *ext = (void *)(chunk + len);
+
+        len += sizeof(*ext);
+        ext->first = s;
+        ext->count = 0;
+        while (s < mirror_nr_sectors && taken < MIRROR_CHUNK_SECTORS && test_bit(s, backup_bits))
+        {
+            __clear_bit(s, backup_bits);
+            mirror_read_sector(s, chunk + len);
+            len += MIRROR_SECTOR_SIZE;
+            ext->count++;
+            taken++;
+            s++;
+        }
+        hdr->nr_extents++;
+        hdr->nr_changed += ext->count;
+        s = find_next_bit(backup_bits, mirror_nr_sectors, s);
+    }
+    *sector = s;
+    return len;
+}
+
+static int backup_write(struct file *filp, const void *buf, size_t len, loff_t *pos)
+{
+    size_t off = 0;
+
+    while (off < len)
+    {
+        ssize_t rc = kernel_write(filp, buf + off, len - off, pos);
+        if (rc < 0) 
+            return rc; 
+        if (rc == 0) 
+            return -EIO; 
+        off += rc;
+        atomic64_add(rc, &backup_bytes);
+    }
+    return 0;
+}
+
+/*
+ * Write a full image, or a delta of the sectors mirrored since the last
+ * backup, a chunk at a time. mirror_mutex is only held while a chunk is
+ * copied out, never across kernel_write(), so mirroring carries on while
+ * the file is written.
+ */
+static int vblock_backup(const char *path, bool delta)
 {
+    struct storage_delta_header hdr = { .magic = STORAGE_DELTA_MAGIC };
     struct file *filp;
+    unsigned char *chunk;
+    sector_t sector = 0;
     loff_t pos = 0;
-    ssize_t written = 0;
+    u64 start, elapsed;
     int ret = 0;
 
     if (!path || !*path)
         return -EINVAL;
 
+    /* Order 6 if it had to be contiguous, vmalloc is fine for kernel_write() */
+    chunk = kvmalloc(MIRROR_CHUNK_SECTORS * (MIRROR_SECTOR_SIZE + sizeof(struct storage_delta_extent)),
+                    GFP_KERNEL);
+    if (!chunk)
+        return -ENOMEM;
+
+    if (mutex_lock_interruptible(&backup_mutex))
+    {
+        kvfree(chunk);
+        return -ERESTARTSYS;
+    }
+
     filp = filp_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (IS_ERR(filp))
+    {
+        mutex_unlock(&backup_mutex);
+        kvfree(chunk);
         return PTR_ERR(filp);
-
-    if (mutex_lock_interruptible(&mirror_mutex)) 
-	{
-        filp_close(filp, NULL);
-        return -ERESTARTSYS;
     }
 
-	while (pos < MIRROR_TOTAL_SIZE) 
-	{
-		size_t to_write = min_t(size_t, MIRROR_TOTAL_SIZE, MIRROR_TOTAL_SIZE - pos);
-		ssize_t rc = kernel_write(filp, mirror_buffer + pos, to_write, &pos);
-		if (rc < 0) 
-		{ 
-			ret = rc; 
-			break; 
-		}
-		if (rc == 0) 
-		{ 
-			ret = -EIO; 
-			break; 
-		}
-		written += rc;
-	}
+    start = ktime_get_ns();
+    atomic64_set(&backup_bytes, 0);
 
-    mutex_unlock(&mirror_mutex);
+    /* Room for the header, filled in once the extents are counted */
+    hdr.sector_size = MIRROR_SECTOR_SIZE;
+    if (delta)
+        ret = backup_write(filp, &hdr, sizeof(hdr), &pos);
+
+    while (!ret)
+    {
+        sector_t first = sector;
+        size_t len;
+
+        mutex_lock(&mirror_mutex);
+        hdr.nr_sectors = mirror_nr_sectors;
+        if (sector >= mirror_nr_sectors)
+            len = 0;
+        else if (delta)
+            len = backup_fill_delta(chunk, &sector, &hdr);
+        else
+            len = backup_fill_full(chunk, &sector);
+        mutex_unlock(&mirror_mutex);
+        if (!len)
+            break;
+
+        ret = backup_write(filp, chunk, len, &pos);
+        if (ret)
+        {
+            /* Those sectors never made it out: keep them for the next delta */
+            mutex_lock(&mirror_mutex);
+            bitmap_set(backup_bits, first, min_t(sector_t, sector, mirror_nr_sectors) - first);
+            mutex_unlock(&mirror_mutex);
+        }
+    }
+
+    if (!ret && delta)
+    {
+        pos = 0;
+        ret = backup_write(filp, &hdr, sizeof(hdr), &pos);
+    }
     filp_close(filp, NULL);
 
-    return ret ? ret : (written == MIRROR_TOTAL_SIZE ? 0 : -EIO);
+    elapsed = ktime_get_ns() - start;
+    backup_kbps = div64_u64((u64)atomic64_read(&backup_bytes) * NSEC_PER_SEC, max_t(u64, elapsed, 1) * 1024);
+    mutex_unlock(&backup_mutex);
+    kvfree(chunk);
+
+    if (!ret)
+        pr_info("storageMirror: %s backup to %s, %lld bytes at %llu KB/s\n",
+                delta ? "delta" : "full", path, (long long)atomic64_read(&backup_bytes), backup_kbps);
+    return ret;
+}
+
+/* Exported: dump the full mirror to a file */
+int vblock_backup_to_file(const char *path)
+{
+    return vblock_backup(path, false);
 }
 EXPORT_SYMBOL(vblock_backup_to_file);
 
+/* Exported: write only the sectors mirrored since the last backup */
+int vblock_backup_delta(const char *path)
+{
+    return vblock_backup(path, true);
+}
+EXPORT_SYMBOL(vblock_backup_delta);
+
+static ssize_t backup_bytes_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&backup_bytes));
+}
+
+static ssize_t backup_kbps_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    return sprintf(buf, "%llu\n", READ_ONCE(backup_kbps));
+}
+
+static ssize_t backup_pending_show(struct kobject *kobj, struct kobj_attribute *attr, char *buf)
+{
+    unsigned int pending = 0;
+
+    mutex_lock(&mirror_mutex);
+    if (backup_bits)
+        pending = bitmap_weight(backup_bits, mirror_nr_sectors);
+    mutex_unlock(&mirror_mutex);
+    return sprintf(buf, "%u\n", pending);
+}
+
+static struct kobj_attribute backup_bytes_attr = __ATTR(backup_bytes, 0444, backup_bytes_show, NULL);
+static struct kobj_attribute backup_kbps_attr = __ATTR(backup_kbps, 0444, backup_kbps_show, NULL);
+static struct kobj_attribute backup_pending_attr = __ATTR(backup_pending_sectors, 0444, backup_pending_show, NULL);
+
+static struct attribute *mirror_attrs[] = {
+    &backup_bytes_attr.attr,
+    &backup_kbps_attr.attr,
+    &backup_pending_attr.attr,
+    NULL,
+};
+
+static struct attribute_group mirror_attr_group = {
+    .attrs = mirror_attrs,
+};
+
+static struct kobject *mirror_kobj;
+
 static int __init mirror_init(void)
 {
-    memset(mirror_buffer, 0, sizeof(mirror_buffer));
+    mirror_cache = kmem_cache_create("storage_mirror_sector", MIRROR_SECTOR_SIZE,
+                                     MIRROR_SECTOR_SIZE, 0, NULL);
+    if (!mirror_cache)
+        return -ENOMEM;
+    xa_init(&mirror_sectors);
     sema_init(&mirror_read_sem, 1);
+
+    mirror_kobj = kobject_create_and_add("storage_mirror", kernel_kobj);
+    if (!mirror_kobj || sysfs_create_group(mirror_kobj, &mirror_attr_group))
+    {
+        kobject_put(mirror_kobj);
+        kmem_cache_destroy(mirror_cache);
+        return -ENOMEM;
+    }
     pr_info("storageMirror: initialized\n");
     return 0;
 }
 
 static void __exit mirror_exit(void)
 {
+    unsigned long sector;
+    unsigned char *buf;
+
+    kobject_put(mirror_kobj);
+    xa_for_each(&mirror_sectors, sector, buf)
+        kmem_cache_free(mirror_cache, buf);
+    xa_destroy(&mirror_sectors);
+    kmem_cache_destroy(mirror_cache);
+    kvfree(backup_bits);
     pr_info("storageMirror: exited\n");
 }
 
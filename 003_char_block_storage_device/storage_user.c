@@ -4,22 +4,18 @@
 #include <sys/ioctl.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+#include <stdint.h>
+#include "storage_ioctl.h"
 
 #define SECTOR_SIZE 512
-#define NUM_SECTORS 8
-
-/* IOCTL commands */
-#define IOCTL_LOCK_SECTOR    	_IOW('L', 0x1, int)
-#define IOCTL_UNLOCK_SECTOR  	_IOW('U', 0x2, int)
-#define IOCTL_GET_LOCK_INFO  	_IOR('I', 0x3, bool[NUM_SECTORS])
-#define IOCTL_ERASE_SECTOR   	_IOW('E', 0x4, int)
-#define IOCTL_MIRROR_SECTOR  	_IOW('M', 0x5, int)
-#define IOCTL_BACKUP_TO_FILE 	_IOW('B', 0x6, char *)
-
-struct unlock_request {
-    int sector;
-    char key;
-};
+#define NUM_SECTORS STORAGE_LOCK_INFO_SECTORS
 
 /* Helper: write one sector */
 int write_sector(int fd, int sector, const void *buf) 
@@ -59,7 +55,496 @@ int read_sector(int fd, int sector, void *buf)
 	return 0;
 }
 
-int main(void)
+/* Capacity as loaded, parsed like the kernel's memparse() */
+static unsigned long long device_capacity(void)
+{
+    char buf[64];
+    char *end;
+    unsigned long long size;
+    FILE *f = fopen("/sys/module/storage_kernel/parameters/storage_size", "r");
+
+    if (!f || !fgets(buf, sizeof(buf), f))
+    {
+        if (f)
+            fclose(f);
+        return NUM_SECTORS * SECTOR_SIZE;
+    }
+    fclose(f);
+
+    size = strtoull(buf, &end, 0);
+    switch (*end)
+    {
+    case 'G': case 'g': size <<= 10;	/* fall through */
+    case 'M': case 'm': size <<= 10;	/* fall through */
+    case 'K': case 'k': size <<= 10;
+    }
+    return size;
+}
+
+#define SCALE_BLOCK 4096
+#define SCALE_SECONDS 2
+
+struct scale_worker {
+    pthread_t thread;
+    int fd;
+    unsigned int seed;
+    unsigned long long blocks;
+    volatile int *stop;
+    unsigned long ops;
+};
+
+/* Random 4K reads and writes, one in four a write, until told to stop */
+static void *scale_thread(void *arg)
+{
+    struct scale_worker *w = arg;
+    char buf[SCALE_BLOCK];
+
+    memset(buf, 0xa5, sizeof(buf));
+    while (!*w->stop)
+    {
+        off_t off = (off_t)(rand_r(&w->seed) % w->blocks) * SCALE_BLOCK;
+        ssize_t ret;
+
+        if (rand_r(&w->seed) % 4 == 0)
+            ret = pwrite(w->fd, buf, SCALE_BLOCK, off);
+        else
+            ret = pread(w->fd, buf, SCALE_BLOCK, off);
+        if (ret == SCALE_BLOCK)
+            w->ops++;
+    }
+    return NULL;
+}
+
+/* Aggregate IOPS for 1, 2, 4 ... max_threads threads sharing one fd */
+static int run_scale(int fd, int max_threads)
+{
+    unsigned long long blocks = device_capacity() / SCALE_BLOCK;
+    struct scale_worker workers[64];
+
+    if (blocks == 0)
+    {
+        fprintf(stderr, "Device smaller than one %d byte block\n", SCALE_BLOCK);
+        return 1;
+    }
+    if (max_threads > 64)
+        max_threads = 64;
+
+    printf("threads  IOPS (4K random, 75%% read)\n");
+    for (int n = 1; n <= max_threads; n *= 2)
+    {
+        volatile int stop = 0;
+        unsigned long total = 0;
+
+        for (int i = 0; i < n; i++)
+        {
+            workers[i] = (struct scale_worker){ .fd = fd, .seed = i + 1, .blocks = blocks, .stop = &stop };
+            pthread_create(&workers[i].thread, NULL, scale_thread, &workers[i]);
+        }
+        sleep(SCALE_SECONDS);
+        stop = 1;
+        for (int i = 0; i < n; i++)
+        {
+            pthread_join(workers[i].thread, NULL);
+            total += workers[i].ops;
+        }
+        printf("%7d  %lu\n", n, total / SCALE_SECONDS);
+    }
+    return 0;
+}
+
+#define VEC_MAX_SEGMENTS 64
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * One sector per segment from separately allocated buffers, written and
+ * read back either with a pwrite()/pread() per segment or with a single
+ * pwritev()/preadv() for the lot. Prints MB/s for each.
+ */
+static int run_vec(int fd, int segments)
+{
+    unsigned long long capacity = device_capacity();
+    struct iovec iov[VEC_MAX_SEGMENTS];
+    int ret = 0;
+
+    if (segments < 1 || segments > VEC_MAX_SEGMENTS)
+        segments = 16;
+    if (capacity < (unsigned long long)segments * SECTOR_SIZE)
+    {
+        fprintf(stderr, "Device smaller than %d sectors\n", segments);
+        return 1;
+    }
+    for (int i = 0; i < segments; i++)
+    {
+        iov[i].iov_base = malloc(SECTOR_SIZE);
+        iov[i].iov_len = SECTOR_SIZE;
+        memset(iov[i].iov_base, i, SECTOR_SIZE);
+    }
+
+    printf("%d x %d byte segments per request\n", segments, SECTOR_SIZE);
+    printf("%-12s  %10s  %10s\n", "mode", "write MB/s", "read MB/s");
+    for (int vectored = 0; vectored <= 1; vectored++)
+    {
+        double mbps[2];
+
+        for (int rw = 0; rw <= 1 && !ret; rw++)
+        {
+            unsigned long bytes = 0;
+            double start = now_seconds(), elapsed;
+
+            do
+            {
+                ssize_t n = 0;
+
+                if (vectored)
+                    n = rw ? preadv(fd, iov, segments, 0) : pwritev(fd, iov, segments, 0);
+                else
+                {
+                    for (int i = 0; i < segments; i++)
+                        n += rw ? pread(fd, iov[i].iov_base, SECTOR_SIZE, (off_t)i * SECTOR_SIZE)
+                                : pwrite(fd, iov[i].iov_base, SECTOR_SIZE, (off_t)i * SECTOR_SIZE);
+                }
+                if (n != (ssize_t)segments * SECTOR_SIZE)
+                {
+                    perror(rw ? "read" : "write");
+                    ret = 1;
+                    break;
+                }
+                bytes += n;
+                elapsed = now_seconds() - start;
+            } while (elapsed < SCALE_SECONDS);
+            mbps[rw] = bytes / elapsed / (1024 * 1024);
+        }
+        if (ret)
+            break;
+        printf("%-12s  %10.1f  %10.1f\n", vectored ? "readv/writev" : "per-segment", mbps[0], mbps[1]);
+    }
+
+    for (int i = 0; i < segments; i++)
+        free(iov[i].iov_base);
+    return ret;
+}
+
+/* Sectors holding any non-zero byte */
+static unsigned long long count_used_sectors(const unsigned char *p, size_t len)
+{
+    unsigned long long used = 0;
+
+    for (size_t off = 0; off + SECTOR_SIZE <= len; off += SECTOR_SIZE)
+    {
+        for (size_t i = 0; i < SECTOR_SIZE; i++)
+        {
+            if (p[off + i])
+            {
+                used++;
+                break;
+            }
+        }
+    }
+    return used;
+}
+
+/*
+ * Scan the whole store for used sectors through pread() and through an
+ * mmap() of the device. The second pass over the mapping runs on pages
+ * that are already faulted in, i.e. at memory speed. Prints MB/s for each.
+ */
+static int run_scan(int fd)
+{
+    size_t capacity = device_capacity();
+    unsigned char *buf = malloc(capacity);
+    unsigned long long used;
+    double start;
+
+    if (!buf)
+        return 1;
+    start = now_seconds();
+    if (pread(fd, buf, capacity, 0) != (ssize_t)capacity)
+    {
+        perror("pread");
+        free(buf);
+        return 1;
+    }
+    used = count_used_sectors(buf, capacity);
+    printf("%-12s  %10.1f MB/s  %llu sectors used\n", "pread",
+           capacity / (now_seconds() - start) / (1024 * 1024), used);
+    free(buf);
+
+    unsigned char *map = mmap(NULL, capacity, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+    for (int pass = 1; pass <= 2; pass++)
+    {
+        start = now_seconds();
+        used = count_used_sectors(map, capacity);
+        printf("mmap pass %d   %10.1f MB/s  %llu sectors used\n", pass,
+               capacity / (now_seconds() - start) / (1024 * 1024), used);
+    }
+    munmap(map, capacity);
+    return 0;
+}
+
+/*
+ * storage_user bench: timed read/write mix for measuring the driver.
+ * Latencies go into log-linear histograms (16 linear steps per power of
+ * two, so within ~6%), one per thread and direction, merged at the end.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+#define BENCH_MAX_THREADS 64
+
+struct bench_config {
+    int threads;
+    size_t block;
+    bool random;
+    int read_pct;
+    int seconds;
+    bool json;
+    bool dsync;
+};
+
+struct bench_hist {
+    unsigned long long count;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+
+struct bench_worker {
+    pthread_t thread;
+    const struct bench_config *cfg;
+    int fd;
+    unsigned int seed;
+    unsigned long long first, blocks;	/* this thread's slice, in blocks */
+    volatile int *stop;
+    unsigned long long errors;
+    struct bench_hist hist[2];		/* [0] reads, [1] writes */
+};
+
+static unsigned int hist_index(uint64_t ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((ns >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lowest value that lands in bucket idx */
+static uint64_t hist_value(unsigned int idx)
+{
+    unsigned int msb;
+
+    if (idx < HIST_SUB)
+        return idx;
+    msb = idx / HIST_SUB + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + idx % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static double hist_percentile_us(const struct bench_hist *h, double pct)
+{
+    unsigned long long want = (unsigned long long)(h->count * pct / 100.0);
+    unsigned long long seen = 0;
+
+    if (!h->count)
+        return 0;
+    for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen > want)
+            return hist_value(i) / 1000.0;
+    }
+    return hist_value(HIST_BUCKETS - 1) / 1000.0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void *bench_thread(void *arg)
+{
+    struct bench_worker *w = arg;
+    const struct bench_config *cfg = w->cfg;
+    unsigned long long next = 0;
+    char *buf;
+
+    if (posix_memalign((void **)&buf, 4096, cfg->block))
+        return NULL;
+    memset(buf, 0x5a, cfg->block);
+
+    while (!*w->stop)
+    {
+        unsigned long long block = cfg->random ? rand_r(&w->seed) % w->blocks : next++ % w->blocks;
+        off_t off = (off_t)(w->first + block) * cfg->block;
+        bool write = rand_r(&w->seed) % 100 >= cfg->read_pct;
+        uint64_t start = now_ns();
+        ssize_t ret;
+
+        if (write)
+            ret = pwrite(w->fd, buf, cfg->block, off);
+        else
+            ret = pread(w->fd, buf, cfg->block, off);
+        if (ret != (ssize_t)cfg->block)
+        {
+            w->errors++;
+            continue;
+        }
+        w->hist[write].buckets[hist_index(now_ns() - start)]++;
+        w->hist[write].count++;
+    }
+    free(buf);
+    return NULL;
+}
+
+static void bench_print_dir(const char *name, const struct bench_hist *h, double elapsed,
+                            size_t block, bool json, bool last)
+{
+    double iops = h->count / elapsed;
+
+    if (json)
+        printf("  \"%s\": {\"ops\": %llu, \"iops\": %.0f, \"mb_per_s\": %.2f, "
+               "\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f}%s\n",
+               name, h->count, iops, iops * block / (1024 * 1024),
+               hist_percentile_us(h, 50), hist_percentile_us(h, 99), hist_percentile_us(h, 99.9),
+               last ? "" : ",");
+    else
+        printf("%-6s %10llu %10.0f %9.2f %9.2f %9.2f %9.2f\n",
+               name, h->count, iops, iops * block / (1024 * 1024),
+               hist_percentile_us(h, 50), hist_percentile_us(h, 99), hist_percentile_us(h, 99.9));
+}
+
+static void bench_usage(void)
+{
+    fprintf(stderr, "usage: storage_user bench [-t threads] [-b block_size] [-p seq|rand]\n"
+                    "                          [-r read_percent] [-s seconds] [-d] [-j]\n"
+                    "  -d  O_DSYNC writes, each waits for a journal commit\n");
+}
+
+static int run_bench(int fd, int argc, char **argv)
+{
+    struct bench_config cfg = { .threads = 1, .block = 4096, .random = true, .read_pct = 70, .seconds = 5 };
+    static struct bench_worker workers[BENCH_MAX_THREADS];
+    struct bench_hist total[2] = { 0 };
+    unsigned long long capacity, blocks, errors = 0;
+    volatile int stop = 0;
+    uint64_t start;
+    double elapsed;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:b:p:r:s:dj")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'b': cfg.block = strtoul(optarg, NULL, 0); break;
+        case 'p': cfg.random = strcmp(optarg, "seq") != 0; break;
+        case 'r': cfg.read_pct = atoi(optarg); break;
+        case 's': cfg.seconds = atoi(optarg); break;
+        case 'j': cfg.json = true; break;
+        case 'd': cfg.dsync = true; break;
+        default: bench_usage(); return 1;
+        }
+    }
+    if (cfg.threads < 1 || cfg.threads > BENCH_MAX_THREADS || !cfg.block ||
+        cfg.block % SECTOR_SIZE || cfg.read_pct < 0 || cfg.read_pct > 100 || cfg.seconds < 1)
+    {
+        bench_usage();
+        return 1;
+    }
+
+    /* O_DSYNC can't be set with fcntl(), so open the device again */
+    if (cfg.dsync)
+    {
+        fd = open("/dev/storageDevice", O_RDWR | O_DSYNC);
+        if (fd < 0)
+        {
+            perror("open O_DSYNC");
+            return 1;
+        }
+    }
+
+    capacity = device_capacity();
+    blocks = capacity / cfg.block;
+    if (blocks < (unsigned long long)cfg.threads)
+    {
+        fprintf(stderr, "Device too small for %d threads of %zu byte blocks\n", cfg.threads, cfg.block);
+        if (cfg.dsync)
+            close(fd);
+        return 1;
+    }
+
+    /* Sequential threads each stream through their own slice; random ones roam the device */
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        struct bench_worker *w = &workers[i];
+
+        memset(w, 0, sizeof(*w));
+        w->cfg = &cfg;
+        w->fd = fd;
+        w->seed = i + 1;
+        w->stop = &stop;
+        w->first = cfg.random ? 0 : blocks / cfg.threads * i;
+        w->blocks = cfg.random ? blocks : blocks / cfg.threads;
+    }
+
+    start = now_ns();
+    for (int i = 0; i < cfg.threads; i++)
+        pthread_create(&workers[i].thread, NULL, bench_thread, &workers[i]);
+    sleep(cfg.seconds);
+    stop = 1;
+    for (int i = 0; i < cfg.threads; i++)
+        pthread_join(workers[i].thread, NULL);
+    elapsed = (now_ns() - start) / 1e9;
+
+    for (int i = 0; i < cfg.threads; i++)
+    {
+        for (int d = 0; d < 2; d++)
+        {
+            total[d].count += workers[i].hist[d].count;
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                total[d].buckets[b] += workers[i].hist[d].buckets[b];
+        }
+        errors += workers[i].errors;
+    }
+
+    if (cfg.json)
+    {
+        printf("{\n  \"threads\": %d,\n  \"block_size\": %zu,\n  \"pattern\": \"%s\",\n"
+               "  \"read_pct\": %d,\n  \"dsync\": %s,\n  \"seconds\": %.3f,\n  \"errors\": %llu,\n",
+               cfg.threads, cfg.block, cfg.random ? "rand" : "seq", cfg.read_pct,
+               cfg.dsync ? "true" : "false", elapsed, errors);
+        bench_print_dir("read", &total[0], elapsed, cfg.block, true, false);
+        bench_print_dir("write", &total[1], elapsed, cfg.block, true, true);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%d threads, %zu byte blocks, %s, %d%% reads%s, %.1f s, %llu errors\n",
+               cfg.threads, cfg.block, cfg.random ? "random" : "sequential", cfg.read_pct,
+               cfg.dsync ? ", O_DSYNC" : "", elapsed, errors);
+        printf("%-6s %10s %10s %9s %9s %9s %9s\n", "", "ops", "IOPS", "MB/s", "p50 us", "p99 us", "p999 us");
+        bench_print_dir("read", &total[0], elapsed, cfg.block, false, false);
+        bench_print_dir("write", &total[1], elapsed, cfg.block, false, true);
+    }
+    if (cfg.dsync)
+        close(fd);
+    return 0;
+}
+
+int main(int argc, char **argv)
 {
     int fd = open("/dev/storageDevice", O_RDWR);
     if (fd < 0) 
@@ -67,6 +552,38 @@ int main(void)
         perror("open");
         return 1;
     }
+    /* storage_user scale [max_threads]: multi-threaded throughput instead of the demo */
+    if (argc > 1 && strcmp(argv[1], "scale") == 0)
+    {
+        int ret = run_scale(fd, argc > 2 ? atoi(argv[2]) : 8);
+        close(fd);
+        return ret;
+    }
+
+    /* storage_user bench [options]: IOPS, MB/s and latency percentiles, optionally as JSON */
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        int ret = run_bench(fd, argc - 1, argv + 1);
+        close(fd);
+        return ret;
+    }
+
+    /* storage_user vec [segments]: vectored vs per-segment I/O */
+    if (argc > 1 && strcmp(argv[1], "vec") == 0)
+    {
+        int ret = run_vec(fd, argc > 2 ? atoi(argv[2]) : 16);
+        close(fd);
+        return ret;
+    }
+
+    /* storage_user scan: look for used sectors through pread() and mmap() */
+    if (argc > 1 && strcmp(argv[1], "scan") == 0)
+    {
+        int ret = run_scan(fd);
+        close(fd);
+        return ret;
+    }
+
     printf("Storage Device: Open Success\n");
 
     /* Prepare a buffer with test data */
@@ -100,9 +617,7 @@ int main(void)
     printf("Sector %d locked\n", sectorLock);
 
     /* Unlock sector 2 */	
-	struct unlock_request req;
-	req.sector = 2;
-	req.key = 'B';
+	struct storage_unlock req = { .sector = 2, .key = "B" };
 
 	if (ioctl(fd, IOCTL_UNLOCK_SECTOR, &req) < 0) 
 	{
@@ -110,7 +625,7 @@ int main(void)
 	} 
 	else 
 	{
-		printf("Sector %d unlocked with key %c\n", req.sector, req.key);
+		printf("Sector %llu unlocked with key %s\n", (unsigned long long)req.sector, req.key);
 	}
 
     /* Get lock info for all sectors */
@@ -126,6 +641,56 @@ int main(void)
 	{
         printf("Sector %d: %s\n", i, lockInfo[i] ? "LOCKED" : "UNLOCKED");
     }
+
+    /* Lock sectors 4-6 in one call and read the state back as a bitmap */
+    struct storage_range range = { .first = 4, .count = 3 };
+    if (ioctl(fd, IOCTL_LOCK_RANGE, &range) < 0)
+        perror("lock_range");
+
+    unsigned char bits[(NUM_SECTORS + 7) / 8];
+    struct storage_lock_bitmap map = {
+        .range = { .first = 0, .count = NUM_SECTORS },
+        .bits = (uintptr_t)bits,
+    };
+    if (ioctl(fd, IOCTL_GET_LOCK_BITMAP, &map) == 0)
+    {
+        printf("Lock bitmap:");
+        for (int i = 0; i < NUM_SECTORS; i++)
+            printf(" %d", (bits[i / 8] >> (i % 8)) & 1);
+        printf("\n");
+    }
+
+    struct storage_range_unlock unlockRange = { .range = range, .key = "A" };
+    if (ioctl(fd, IOCTL_UNLOCK_RANGE, &unlockRange) < 0)
+        perror("unlock_range");
+    else
+        printf("Sectors %llu-%llu unlocked with key %s\n", (unsigned long long)range.first,
+               (unsigned long long)(range.first + range.count - 1), unlockRange.key);
+
+    /*
+     * Only the third key (C) may unlock sector 3 (needs root), then lock
+     * sectors 1 and 3 and unlock both in one call: A is refused, C works
+     */
+    struct storage_key_acl acl = { .range = { .first = 3, .count = 1 }, .keys = 1 << 2 };
+    if (ioctl(fd, IOCTL_SET_SECTOR_KEYS, &acl) < 0)
+        perror("set_sector_keys");
+
+    struct storage_range lockRanges[] = { { .first = 1, .count = 1 }, { .first = 3, .count = 1 } };
+    for (int i = 0; i < 2; i++)
+        if (ioctl(fd, IOCTL_LOCK_RANGE, &lockRanges[i]) < 0)
+            perror("lock_range");
+
+    struct storage_unlock_ranges bulk = { .ranges = (uintptr_t)lockRanges, .nr = 2, .key = "A" };
+    if (ioctl(fd, IOCTL_UNLOCK_RANGES, &bulk) < 0)
+        printf("Sectors 1 and 3 not unlocked with key %s: %s\n", bulk.key, strerror(errno));
+    strcpy(bulk.key, "C");
+    if (ioctl(fd, IOCTL_UNLOCK_RANGES, &bulk) < 0)
+        perror("unlock_ranges");
+    else
+        printf("Sectors 1 and 3 unlocked with key %s\n", bulk.key);
+
+    acl.keys = 0;
+    ioctl(fd, IOCTL_SET_SECTOR_KEYS, &acl);
 	
 	/* Mirror Sector 2 */
     int sectorMirror = 0;
@@ -137,6 +702,10 @@ int main(void)
     }
     printf("Sector %d mirrored\n", sectorMirror);
 
+    /* Writes reach the mirror in the background; flush them before the backup */
+    if (ioctl(fd, IOCTL_MIRROR_SYNC) < 0)
+        perror("mirror_sync");
+
     /* Backup full storage to file */
     char backupPath[64];
     strcpy(backupPath, "./storage_backup.bin");
@@ -148,6 +717,62 @@ int main(void)
     }
     printf("Storage backup written to %s\n", backupPath);
 
+    /* Change one sector, then back up just what changed since the full backup */
+    if (write_sector(fd, 1, wBuf) == 0 && ioctl(fd, IOCTL_MIRROR_SYNC) == 0)
+    {
+        char deltaPath[64];
+        strcpy(deltaPath, "./storage_delta.bin");
+        if (ioctl(fd, IOCTL_BACKUP_DELTA, deltaPath) < 0)
+            perror("backup_delta");
+        else
+            printf("Delta backup written to %s\n", deltaPath);
+    }
+
+    /* Snapshot, overwrite sector 0, then read the old contents through the snapshot */
+    char snapName[STORAGE_SNAP_NAME_LEN] = "demo";
+    if (ioctl(fd, IOCTL_SNAP_CREATE, snapName) < 0)
+        perror("snap_create");
+    else
+    {
+        printf("Snapshot %s created\n", snapName);
+        char zBuf[SECTOR_SIZE];
+        memset(zBuf, 0xEE, sizeof(zBuf));
+        write_sector(fd, 0, zBuf);
+
+        int snapFd = open("/dev/storageSnap", O_RDONLY);
+        if (snapFd < 0)
+            perror("open snapshot");
+        else
+        {
+            printf("Sector 0 as of snapshot %s:\n", snapName);
+            read_sector(snapFd, 0, rBuf);
+            close(snapFd);
+        }
+        if (ioctl(fd, IOCTL_SNAP_DELETE, snapName) < 0)
+            perror("snap_delete");
+        else
+            printf("Snapshot %s deleted\n", snapName);
+    }
+
+    /* Write sector 1 through a shared mapping, sync it and read it back */
+    unsigned char *mapped = mmap(NULL, NUM_SECTORS * SECTOR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+        perror("mmap");
+    else
+    {
+        struct storage_range syncRange = { .first = 0, .count = NUM_SECTORS };
+        char mBuf[SECTOR_SIZE];
+
+        printf("Sector 0 through the mapping starts with %d\n", mapped[0]);
+        memset(mapped + SECTOR_SIZE, 0x5A, SECTOR_SIZE);
+        if (ioctl(fd, IOCTL_MMAP_SYNC, &syncRange) < 0)
+            perror("mmap_sync");
+        else if (read_sector(fd, 1, mBuf) == 0)
+            printf("Sector 1 after mmap sync: %s\n",
+                   memcmp(mBuf, mapped + SECTOR_SIZE, SECTOR_SIZE) == 0 ? "matches" : "differs");
+        munmap(mapped, NUM_SECTORS * SECTOR_SIZE);
+    }
+
     /* Erase sector 4 */
     int sectorErase = 4;
     if (ioctl(fd, IOCTL_ERASE_SECTOR, &sectorErase) < 0) 
@@ -158,6 +783,14 @@ int main(void)
     }
     printf("Sector %d erased\n", sectorErase);
 
+    /* Erase and deallocate sectors 5-7 in one call */
+    struct storage_range eraseRange = { .first = 5, .count = 3 };
+    if (ioctl(fd, IOCTL_ERASE_RANGE, &eraseRange) < 0)
+        perror("erase_range");
+    else
+        printf("Sectors %u-%u erased\n", (unsigned)eraseRange.first,
+               (unsigned)(eraseRange.first + eraseRange.count - 1));
+
     close(fd);
     return 0;
 }